@@ -2,7 +2,7 @@ import sys, os, shutil
 import argparse
 
 
-from Segmentation.Segmentation import Segmentator
+from Segmentation.Segmentation import Segmentator, TemplateStore, OUTPUT_IRIS_NORMALIZED
 from Models.VGGFE import VGGFE
 from Models.FeatNetFE import FeatNet
 from torchvision.io import read_image
@@ -23,21 +23,29 @@ class FeatureExtractor:
             transforms.Resize((self.imgHeight, self.imgWidth)),
             transforms.ToTensor()
         ])
+        self.toTensor = transforms.ToTensor()
     
     def extract(self, img):
         if type(img) == type(''):
             img = read_image(img)
-        # prepare image for feature extraction
-        img = self.transform(img)
+        elif isinstance(img, np.ndarray):
+            # images from the segmentator may be views with negative strides
+            img = np.ascontiguousarray(img)
+        # prepare image for feature extraction, no resize if the segmentator already produced the right size
+        if tuple(img.shape[:2]) == (self.imgHeight, self.imgWidth):
+            img = self.toTensor(img)
+        else:
+            img = self.transform(img)
         img = img.reshape(1, 3, self.imgHeight, self.imgWidth)
 
         return self.model(img)[0].detach().numpy()
 
 class Dataset:
-    def __init__(self, path, featureExtractor):
+    def __init__(self, path, featureExtractor, socketPath=None):
         self.path = path
-        self.segmentator = Segmentator()
-        self.launchParams = {"debug":True, "out":os.path.abspath("./.tmp"), "mode": "segmentation"}
+        self.segmentator = Segmentator(socketPath)
+        self.launchParams = {"debug":True, "out":os.path.abspath("./.tmp"), "mode": "segmentation",
+                             "normsize": f"{featureExtractor.imgWidth}x{featureExtractor.imgHeight}", "sampling": "area"}
         
         self.idCounter = 0
         
@@ -45,19 +53,47 @@ class Dataset:
         
         # private members
         self.__isCsvCreated = os.path.exists(self.path)
+        # ".tpl" datasets are binary template stores, others are csv files
+        self.__store = TemplateStore(self.path) if self.path.endswith(".tpl") else None
 
     def dataframe(self):
         if self.__isCsvCreated:
             return pd.read_csv(self.path)
 
+    def templates(self):
+        """Features (N x dim) and labels (N) of every enrolled template"""
+        if self.__store is not None:
+            return self.__store.templates()
+        if not self.__isCsvCreated:
+            return np.empty((0, 0)), np.empty(0, dtype=int)
+        rows = self.dataframe().to_numpy()
+        return rows[:, :-1], rows[:, -1].astype(int)
+
+    def templatesOf(self, id):
+        """Features and labels of the templates enrolled with an identity"""
+        features, labels = self.templates()
+        if self.__store is not None:
+            indices = self.__store.templatesOf(id)
+            return features[indices], labels[indices]
+        return features[labels == id], labels[labels == id]
+
+    def identify(self, probeFeatures, maxRank, threshold=None):
+        """Native 1:N search of a template store, None when the dataset is a csv file"""
+        if self.__store is None:
+            return None
+        return self.__store.identify(probeFeatures, maxRank, threshold)
+
     def enrollSubject(self, imgPath, id):
         # segment the image
-        _, segmented, _, _ = self.segmentator.segment(imgPath, **self.launchParams)
+        _, segmented, _, _ = self.segmentator.segment(imgPath, outputs=OUTPUT_IRIS_NORMALIZED, **self.launchParams)
         
         if type(segmented) == type(None):
             return False
         # extract features
         features = self.featureExtractor.extract(segmented) 
+
+        if self.__store is not None:
+            return self.__store.append(id, features)
         
         # check if csv file is created, if not create it
         if not self.__isCsvCreated:
@@ -78,7 +114,9 @@ if __name__ == "__main__":
     parser.add_argument('--id', metavar='claimed_identity', type=int, nargs=1, required=True,
                     help='Claimed identity')
     parser.add_argument('--dataset', metavar='dataset_filepath', type=str, nargs=1, required=True,
-                    help='Dataset csv file')
+                    help='Dataset file: csv, or binary template store if it ends with ".tpl"')
+    parser.add_argument('--socket', metavar='socket_path', type=str, nargs=1, required=False,
+                    help='Socket of a running "SegmentatorApp --serve", if not set the segmentator is launched')
 
     args = vars(parser.parse_args())
     inputImagePath = args['in'][0]
@@ -89,5 +127,5 @@ if __name__ == "__main__":
     featNet = FeatNet(pretrainedName="featNetTriplet_100e_1e-4lr.pth").eval()
     
     featureExtractor = FeatureExtractor(featNet)
-    dataset = Dataset(datasetPath, featureExtractor)
+    dataset = Dataset(datasetPath, featureExtractor, args['socket'][0] if args['socket'] else None)
     dataset.enrollSubject(inputImagePath, claimedIdentity)
\ No newline at end of file
@@ -10,6 +10,7 @@ import numpy as np
 from scipy.spatial.distance import pdist
 
 from Enrollment import Dataset, FeatureExtractor
+from Segmentation.Segmentation import OUTPUT_IRIS_NORMALIZED
 from Models.VGGFE import VGGFE
 from Models.FeatNetFE import FeatNet
 
@@ -22,24 +23,29 @@ class SubjectIdentifier:
 
         self.at = acceptanceThreshold
     def identify(self, img, maxRank : int=1) -> List:
-        _, segmented, _, _ = self.segmentator.segment(img, **self.dataset.launchParams)
+        _, segmented, _, _ = self.segmentator.segment(img, outputs=OUTPUT_IRIS_NORMALIZED, **self.dataset.launchParams)
         
         if type(segmented) == type(None):
             return []
         
         probeFeatures = self.featureExtractor.extract(segmented)
-        df = self.dataset.dataframe()
+
+        # template stores are searched natively
+        matches = self.dataset.identify(probeFeatures, maxRank, self.at if type(self.at) == type(float()) else None)
+        if matches is not None:
+            return matches
+
+        features, labels = self.dataset.templates()
 
         # no user found with that claimed id
-        if len(df) == 0:
+        if len(features) == 0:
             return []
 
         # calc distance with every template
         distances = []
-        for row in df.to_numpy():
-            rowFeatures = row.reshape(1, -1)
-            stacked = np.vstack((rowFeatures[:, :-1], probeFeatures.reshape(1, -1)))
-            distances += [(pdist(stacked, metric='euclidean')[0], int(rowFeatures[0, -1]))]
+        for rowFeatures, label in zip(features, labels):
+            stacked = np.vstack((rowFeatures.reshape(1, -1), probeFeatures.reshape(1, -1)))
+            distances += [(pdist(stacked, metric='euclidean')[0], int(label))]
         
         distances.sort(key=lambda el: el[0])
         if type(self.at) == type(float()):
@@ -54,7 +60,9 @@ if __name__ == '__main__':
     parser.add_argument('--at', metavar='th', type=float, nargs=1, required=False,
                     help='Acceptance theshold, if not set we assume it\'s a cloded set')
     parser.add_argument('--dataset', metavar='dataset_filepath', type=str, nargs=1, required=True,
-                    help='Dataset csv file')
+                    help='Dataset file: csv, or binary template store if it ends with ".tpl"')
+    parser.add_argument('--socket', metavar='socket_path', type=str, nargs=1, required=False,
+                    help='Socket of a running "SegmentatorApp --serve", if not set the segmentator is launched')
 
     args = vars(parser.parse_args())
     inputImagePath = args['in'][0]
@@ -68,7 +76,7 @@ if __name__ == '__main__':
     featNet = FeatNet(pretrainedName="featNetTriplet_100e_1e-4lr.pth").eval()
 
     featureExtractor = FeatureExtractor(featNet)
-    dataset = Dataset(datasetPath, featureExtractor)
+    dataset = Dataset(datasetPath, featureExtractor, args['socket'][0] if args['socket'] else None)
     subjectIdentifier = SubjectIdentifier(dataset, at)
 
     users = subjectIdentifier.identify(inputImagePath)
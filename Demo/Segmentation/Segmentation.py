@@ -2,6 +2,11 @@ import sys
 import os
 import subprocess
 import shutil
+import socket
+import struct
+import ctypes
+
+import numpy as np
 
 # from torchvision.io import read_image
 import cv2
@@ -11,23 +16,265 @@ def read_image(imgPath):
     img = cv2.cvtColor(img, cv2.COLOR_BGR2RGB)
     return img
 
+# SegmentatorApp --serve wire format (see Server/SegmentationServer.h)
+REQUEST_PATH = 1
+# Output images, also used by the native library and the executable (Normalization.h)
+OUTPUT_IRIS_NORMALIZED = 1
+OUTPUT_IRIS_NORMALIZED_MASK = 2
+OUTPUT_EYE_MASK = 4
+OUTPUT_EYE = 8
+OUTPUT_ALL = 15
+# SegmentatorApp --outputs names
+OUTPUT_NAMES = {OUTPUT_IRIS_NORMALIZED: "eyenorm", OUTPUT_IRIS_NORMALIZED_MASK: "eyenormmask", OUTPUT_EYE_MASK: "eyemask", OUTPUT_EYE: "eye"}
+STATUS_OK = 0
+REQUEST_HEADER = struct.Struct('<BBHI')
+REPLY_HEADER = struct.Struct('<BBH6i')
+IMAGE_HEADER = struct.Struct('<III')
+
+def recv_exactly(sock, size):
+    buf = bytearray(size)
+    view = memoryview(buf)
+    while size > 0:
+        n = sock.recv_into(view, size)
+        if n == 0:
+            raise ConnectionError("Segmentation server closed the connection")
+        view = view[n:]
+        size -= n
+    return buf
+
+def to_rgb(img):
+    """BGR or grayscale image to the format of read_image (3 channels RGB), so that every backend returns the same images"""
+    if img is None:
+        return None
+    return cv2.cvtColor(img, cv2.COLOR_BGR2RGB if img.ndim == 3 else cv2.COLOR_GRAY2RGB)
+
+def recv_image(sock):
+    rows, cols, cvType = IMAGE_HEADER.unpack(recv_exactly(sock, IMAGE_HEADER.size))
+    channels = (cvType >> 3) + 1
+    img = np.frombuffer(recv_exactly(sock, rows * cols * channels), dtype=np.uint8)
+    img = img.reshape(rows, cols, channels) if channels > 1 else img.reshape(rows, cols)
+    return to_rgb(img)
+
+# In-process segmentation through the C binding (Binding/SegmentatorC.h)
+class ErbImage(ctypes.Structure):
+    _fields_ = [("data", ctypes.c_void_p), ("rows", ctypes.c_int32), ("cols", ctypes.c_int32),
+                ("channels", ctypes.c_int32), ("step", ctypes.c_int64)]
+
+class ErbSegmentation(ctypes.Structure):
+    _fields_ = [("valid", ctypes.c_int32), ("pupil", ctypes.c_int32 * 3), ("limbus", ctypes.c_int32 * 3),
+                ("eye", ErbImage), ("irisNormalized", ErbImage), ("eyeMask", ErbImage), ("irisNormalizedMask", ErbImage),
+                ("handle", ctypes.c_void_p)]
+
+SAMPLING = {"nearest": 0, "bilinear": 1, "area": 2}
+
+def load_native_library():
+    binDir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "bin")
+    for name in ["libSegmentatorC.so", "libSegmentatorC.dylib", "SegmentatorC.dll"]:
+        path = os.path.join(binDir, name)
+        if os.path.exists(path):
+            # CDLL releases the GIL while the native code runs
+            lib = ctypes.CDLL(path)
+            lib.erb_segmentator_create.restype = ctypes.c_void_p
+            lib.erb_segmentator_create.argtypes = [ctypes.c_char_p, ctypes.c_int32, ctypes.c_int32, ctypes.c_int32, ctypes.c_int32, ctypes.c_char_p]
+            lib.erb_segmentator_destroy.argtypes = [ctypes.c_void_p]
+            lib.erb_segment.restype = ctypes.POINTER(ErbSegmentation)
+            lib.erb_segment.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int32, ctypes.c_int32, ctypes.c_int64, ctypes.c_int32]
+            lib.erb_segment_file.restype = ctypes.POINTER(ErbSegmentation)
+            lib.erb_segment_file.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int32]
+            lib.erb_segmentation_free.argtypes = [ctypes.POINTER(ErbSegmentation)]
+            lib.erb_set_execution.argtypes = [ctypes.c_int32, ctypes.c_int32]
+            lib.erb_store_open.restype = ctypes.c_void_p
+            lib.erb_store_open.argtypes = [ctypes.c_char_p, ctypes.c_int32]
+            lib.erb_store_close.argtypes = [ctypes.c_void_p]
+            lib.erb_store_append.restype = ctypes.c_int32
+            lib.erb_store_append.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.c_void_p]
+            lib.erb_store_size.restype = ctypes.c_int64
+            lib.erb_store_size.argtypes = [ctypes.c_void_p]
+            lib.erb_store_dim.restype = ctypes.c_int32
+            lib.erb_store_dim.argtypes = [ctypes.c_void_p]
+            lib.erb_store_data.restype = ctypes.c_void_p
+            lib.erb_store_data.argtypes = [ctypes.c_void_p]
+            lib.erb_store_record_size.restype = ctypes.c_int64
+            lib.erb_store_record_size.argtypes = [ctypes.c_void_p]
+            lib.erb_store_templates_of.restype = ctypes.c_int64
+            lib.erb_store_templates_of.argtypes = [ctypes.c_void_p, ctypes.c_int64, ctypes.c_void_p, ctypes.c_int64]
+            lib.erb_identify.restype = ctypes.c_int64
+            lib.erb_identify.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int64, ctypes.c_float, ctypes.c_int32, ctypes.c_void_p, ctypes.c_void_p]
+            # one segmentation or identification uses every core (thread pool)
+            lib.erb_set_execution(1, 0)
+            return lib
+    return None
+
+class NativeSegmentation:
+    """Segmentation result, images are numpy views over the native buffers (BGR) and keep them alive"""
+    def __init__(self, lib, result):
+        self.__lib = lib
+        self.__result = result
+        data = result.contents
+        self.valid = bool(data.valid)
+        self.pupil = tuple(data.pupil)
+        self.limbus = tuple(data.limbus)
+        self.eye = self.__view(data.eye)
+        self.irisNormalized = self.__view(data.irisNormalized)
+        self.eyeMask = self.__view(data.eyeMask)
+        self.irisNormalizedMask = self.__view(data.irisNormalizedMask)
+
+    def __view(self, image):
+        if not image.data:
+            return None
+        buf = (ctypes.c_uint8 * (image.step * (image.rows - 1) + image.cols * image.channels)).from_address(image.data)
+        buf._owner = self
+        if image.channels > 1:
+            return np.ndarray((image.rows, image.cols, image.channels), np.uint8, buf, strides=(image.step, image.channels, 1))
+        return np.ndarray((image.rows, image.cols), np.uint8, buf, strides=(image.step, 1))
+
+    def __del__(self):
+        self.__lib.erb_segmentation_free(self.__result)
+
+class NativeSegmentator:
+    def __init__(self, lib, method="hough", size=250, normsize=None, sampling="nearest"):
+        self.lib = lib
+        normWidth, normHeight = [int(v) for v in normsize.split("x")] if normsize else (0, 0)
+        cascade = os.path.join(os.path.dirname(os.path.abspath(__file__)), "haarcascade_eye_tree_eyeglasses.xml")
+        self.handle = lib.erb_segmentator_create(method.encode(), int(size), normWidth, normHeight, SAMPLING[sampling], cascade.encode())
+        if not self.handle:
+            raise ValueError(f"Unknown segmentation method {method}")
+
+    def segment(self, img, outputs=OUTPUT_ALL):
+        """Segment a BGR numpy image, the image is not copied. Images not in outputs are None"""
+        img = np.ascontiguousarray(img)
+        result = self.lib.erb_segment(self.handle, img.ctypes.data, img.shape[0], img.shape[1], img.strides[0], outputs)
+        return NativeSegmentation(self.lib, result)
+
+    def segmentFile(self, path, outputs=OUTPUT_ALL):
+        """Read and segment an image file, JPEG files are decoded at full resolution only in the eye crop"""
+        result = self.lib.erb_segment_file(self.handle, path.encode(), outputs)
+        return NativeSegmentation(self.lib, result)
+
+    def __del__(self):
+        self.lib.erb_segmentator_destroy(self.handle)
+
+class TemplateStore:
+    """Binary gallery of templates (Gallery/TemplateStore.h), memory mapped by the native library"""
+    # features start at this offset in each record
+    FEATURES_OFFSET = 64
+
+    def __init__(self, path):
+        self.lib = load_native_library()
+        if self.lib is None:
+            raise RuntimeError("Template stores need the native segmentator library in Segmentation/bin")
+        self.path = path
+        self.handle = None
+
+    def __open(self, dim=0):
+        # a new store can be created only once the features size is known
+        if self.handle is None and (dim > 0 or os.path.exists(self.path)):
+            self.handle = self.lib.erb_store_open(self.path.encode(), dim)
+            if not self.handle:
+                raise RuntimeError(f"Cannot open template store {self.path}")
+        return self.handle is not None
+
+    def append(self, identity, features):
+        features = np.ascontiguousarray(features, dtype=np.float32)
+        self.__open(features.shape[0])
+        return bool(self.lib.erb_store_append(self.handle, int(identity), features.ctypes.data))
+
+    def templates(self):
+        """Features (N x dim) and labels (N) of every template, views over the mapped file valid until the next append"""
+        size = self.lib.erb_store_size(self.handle) if self.__open() else 0
+        if size == 0:
+            return np.empty((0, 0), dtype=np.float32), np.empty(0, dtype=np.int64)
+        dim = self.lib.erb_store_dim(self.handle)
+        recordSize = self.lib.erb_store_record_size(self.handle)
+        buf = (ctypes.c_uint8 * (size * recordSize)).from_address(self.lib.erb_store_data(self.handle))
+        buf._owner = self
+        features = np.ndarray((size, dim), np.float32, buf, offset=self.FEATURES_OFFSET, strides=(recordSize, 4))
+        labels = np.ndarray((size,), np.int64, buf, offset=0, strides=(recordSize,))
+        return features, labels
+
+    def templatesOf(self, identity):
+        """Indices of the templates of an identity"""
+        if not self.__open():
+            return []
+        count = self.lib.erb_store_templates_of(self.handle, int(identity), None, 0)
+        indices = (ctypes.c_int64 * count)()
+        self.lib.erb_store_templates_of(self.handle, int(identity), indices, count)
+        return list(indices)
+
+    def identify(self, probe, maxRank=1, threshold=None, threads=0):
+        """(distance, identity) of the maxRank templates closest to the probe, closer than threshold if set"""
+        if maxRank <= 0 or not self.__open():
+            return []
+        probe = np.ascontiguousarray(probe, dtype=np.float32).reshape(-1)
+        distances = np.empty(maxRank, dtype=np.float32)
+        identities = np.empty(maxRank, dtype=np.int64)
+        count = self.lib.erb_identify(self.handle, probe.ctypes.data, maxRank, -1.0 if threshold is None else threshold,
+                                      threads, distances.ctypes.data, identities.ctypes.data)
+        return [(float(distances[i]), int(identities[i])) for i in range(count)]
+
+    def __del__(self):
+        if self.handle:
+            self.lib.erb_store_close(self.handle)
+
 class Segmentator:
-    def __init__(self):
+    def __init__(self, socketPath=None):
         self.path = "./bin/SegmentatorApp"
+        # if set, images are segmented by a running "SegmentatorApp --serve socketPath"
+        self.socketPath = socketPath
+        self.__sock = None
+        # otherwise the native library is used if available, the executable if not
+        self.__lib = load_native_library() if socketPath is None else None
+        self.__native = {}
+
+    def __segmentNative(self, imagePath, **kwargs):
+        params = (kwargs.get("method", "hough"), kwargs.get("size", 250), kwargs.get("normsize"), kwargs.get("sampling", "nearest"))
+        if params not in self.__native:
+            self.__native[params] = NativeSegmentator(self.__lib, *params)
+        segmentation = self.__native[params].segmentFile(imagePath, kwargs.get("outputs", OUTPUT_ALL))
+        if not segmentation.valid:
+            print("Segmentation process failed", file=sys.stderr)
+            return None, None, None, None
+        # RGB copies, as read_image
+        return to_rgb(segmentation.eye), to_rgb(segmentation.irisNormalized), to_rgb(segmentation.eyeMask), to_rgb(segmentation.irisNormalizedMask)
+
+    def __segmentRemote(self, imagePath, outputs):
+        if self.__sock is None:
+            self.__sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self.__sock.connect(self.socketPath)
+        path = imagePath.encode('utf-8')
+        self.__sock.sendall(REQUEST_HEADER.pack(REQUEST_PATH, outputs, 0, len(path)) + path)
+        status, outputs, _, *circles = REPLY_HEADER.unpack(recv_exactly(self.__sock, REPLY_HEADER.size))
+        if status != STATUS_OK:
+            print("Segmentation process failed", file=sys.stderr)
+            return None, None, None, None
+        # outputs order: normalized iris, normalized mask, eye mask, eye
+        images = [recv_image(self.__sock) if outputs & (1 << i) else None for i in range(4)]
+        eyeNorm, eyeNormMask, eyeMask, eye = images
+        return eye, eyeNorm, eyeMask, eyeNormMask
 
-    def segment(self, imagePath, **kwargs):
+    def segment(self, imagePath, outputs=OUTPUT_ALL, **kwargs):
+        """(eye, irisNormalized, eyeMask, irisNormalizedMask) images, only those in outputs are computed, the others are None"""
         imagePath = os.path.abspath(imagePath)
+        if self.socketPath is not None and kwargs.get('mode') == 'segmentation':
+            return self.__segmentRemote(imagePath, outputs)
+        if self.__lib is not None and kwargs.get('mode') == 'segmentation':
+            return self.__segmentNative(imagePath, outputs=outputs, **kwargs)
         listCommand = [self.path, "--in", imagePath]
         flagMode = False
         if 'method' in kwargs:
             listCommand += ["--method", kwargs["method"]]
         if 'size' in kwargs:
             listCommand += ["--size", kwargs["size"]]
+        if 'normsize' in kwargs:
+            listCommand += ["--normsize", kwargs["normsize"]]
+        if 'sampling' in kwargs:
+            listCommand += ["--sampling", kwargs["sampling"]]
         if 'mode' in kwargs:
             listCommand += ["--mode", kwargs["mode"]]
             flagMode = kwargs["mode"] == "segmentation"
         if 'out' in kwargs and flagMode:
             listCommand += ["--out", kwargs["out"]]
+            listCommand += ["--outputs", ",".join(name for bit, name in OUTPUT_NAMES.items() if outputs & bit)]
         if 'debug' in kwargs and kwargs["debug"]:
             command = " ".join(listCommand)
             print(f"Launching command: {command}")
@@ -50,15 +297,20 @@ class Segmentator:
         eyeNormMaskPath = os.path.join(outPath, imgName+"_eyeNormMask" + imgExt)
         eyeMaskPath = os.path.join(outPath, imgName+"_eyeMask" + imgExt)
 
-        if not os.path.exists(eyeNormPath):
+        # only the asked images are saved
+        paths = {OUTPUT_IRIS_NORMALIZED: eyeNormPath, OUTPUT_EYE: eyePath, OUTPUT_IRIS_NORMALIZED_MASK: eyeNormMaskPath, OUTPUT_EYE_MASK: eyeMaskPath}
+        paths = {bit: path for bit, path in paths.items() if outputs & bit}
+        if not paths or not all(os.path.exists(path) for path in paths.values()):
             print("Segmentation process failed", file=sys.stderr)
             return None, None, None, None;
 
+        eye, eyeNorm, eyeMask, eyeNormMask = None, None, None, None
+        read = lambda bit: read_image(paths[bit]) if bit in paths else None
         try:
-            eyeNorm = read_image(eyeNormPath)
-            eye = read_image(eyePath)
-            eyeNormMask = read_image(eyeNormMaskPath)
-            eyeMask = read_image(eyeMaskPath)
+            eyeNorm = read(OUTPUT_IRIS_NORMALIZED)
+            eye = read(OUTPUT_EYE)
+            eyeNormMask = read(OUTPUT_IRIS_NORMALIZED_MASK)
+            eyeMask = read(OUTPUT_EYE_MASK)
         except:
             # delete temp. files
             shutil.rmtree(os.path.dirname(eyeNormPath))
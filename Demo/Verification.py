@@ -5,6 +5,7 @@ import numpy as np
 from scipy.spatial.distance import pdist
 
 from Enrollment import Dataset, FeatureExtractor
+from Segmentation.Segmentation import OUTPUT_IRIS_NORMALIZED
 from Models.VGGFE import VGGFE
 from Models.FeatNetFE import FeatNet
 
@@ -17,23 +18,21 @@ class IdentityVerifier:
         self.at = acceptanceThreshold
 
     def verify(self, img, claimedId : int) -> bool:
-        _, segmented, _, _ = self.segmentator.segment(img, **self.dataset.launchParams)
+        _, segmented, _, _ = self.segmentator.segment(img, outputs=OUTPUT_IRIS_NORMALIZED, **self.dataset.launchParams)
         
         if type(segmented) == type(None):
             return False
 
         probeFeatures = self.featureExtractor.extract(segmented)
-        df = self.dataset.dataframe()
-        df = df[df['label'] == claimedId]
+        features, _ = self.dataset.templatesOf(claimedId)
         # no user found with that claimed id
-        if len(df) == 0:
+        if len(features) == 0:
             return False
         
         # calc distance with every template associated to that claimed id
         minDistance = sys.float_info.max
-        for row in df.to_numpy():
-            rowFeatures = row.reshape(1, -1)
-            stacked = np.vstack((rowFeatures[:, :-1], probeFeatures.reshape(1, -1)))
+        for rowFeatures in features:
+            stacked = np.vstack((rowFeatures.reshape(1, -1), probeFeatures.reshape(1, -1)))
             minDistance = min(minDistance, pdist(stacked, metric='euclidean')[0])
         return minDistance < self.at
             
@@ -46,7 +45,9 @@ if __name__ == '__main__':
     parser.add_argument('--id', metavar='claimed_identity', type=int, nargs=1, required=True,
                     help='Claimed identity')
     parser.add_argument('--dataset', metavar='dataset_filepath', type=str, nargs=1, required=True,
-                    help='Dataset csv file')
+                    help='Dataset file: csv, or binary template store if it ends with ".tpl"')
+    parser.add_argument('--socket', metavar='socket_path', type=str, nargs=1, required=False,
+                    help='Socket of a running "SegmentatorApp --serve", if not set the segmentator is launched')
 
     args = vars(parser.parse_args())
     inputImagePath = args['in'][0]
@@ -57,7 +58,7 @@ if __name__ == '__main__':
     # vggfe = VGGFE(pretrainedName='vggfe_lr0001_100e.pth')
     
     featureExtractor = FeatureExtractor(featNet)
-    dataset = Dataset(datasetPath, featureExtractor)
+    dataset = Dataset(datasetPath, featureExtractor, args['socket'][0] if args['socket'] else None)
     identityVerifier = IdentityVerifier(dataset)
 
     if identityVerifier.verify(inputImagePath, claimedIdentity):
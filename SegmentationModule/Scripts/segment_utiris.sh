@@ -1,13 +1,15 @@
+# Usage: segment_utiris.sh inputDirectory outputDirectory [limit]
 limit="$3"
-count=0
+# manifest paths are relative to the manifest itself, so list them as absolute paths
+dir="$(cd "$1" && pwd)"
+manifest="$(mktemp)"
 
-for file in "$1"/*
-do
-    printf "Executing: ./Segmentator.exe on %s\n" "$file"
-    ./Segmentator.exe "-i $file -o $2 -mt hough --size 250 --mode segmentation"
-    ((count=count+1))
-    if [ "$count" -eq "$limit" ]; then
-        break
-    fi
-    printf "\n\n"
-done
+if [ -n "$limit" ]; then
+    ls -1 "$dir"/* | head -n "$limit" > "$manifest"
+else
+    ls -1 "$dir"/* > "$manifest"
+fi
+
+printf "Executing: ./SegmentatorApp on %s\n" "$1"
+./SegmentatorApp --batch "$manifest" -o "$2" -mt hough --size 250 -j "$(nproc)"
+rm -f "$manifest"
@@ -0,0 +1,179 @@
+#include "Binding/SegmentatorC.h"
+#include "Hough/HoughSegmentator.h"
+#include "Isis/IsisSegmentator.h"
+#include "Execution.h"
+#include "Gallery/Identification.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <string>
+
+namespace
+{
+// Keeps the images referenced by an ErbSegmentation alive
+struct SegmentationOwner
+{
+    ErbSegmentation view{};
+    erb::SegmentationData data;
+};
+
+ErbImage imageView(const cv::Mat& img)
+{
+    return ErbImage{ img.data, img.rows, img.cols, img.channels(), (int64_t)img.step[0] };
+}
+
+// Returned when even the result cannot be allocated: not valid, no images, erb_segmentation_free does nothing with it
+ErbSegmentation failedSegmentation{};
+
+/*
+* Segment the image returned by load() and build the views of the result.
+* No exception reaches the C caller, errors give a result that is not valid
+*/
+template<typename Load>
+ErbSegmentation* segment(const erb::Segmentator* segmentator, Load&& load, int32_t outputs)
+{
+    std::unique_ptr<SegmentationOwner> owner;
+    try
+    {
+        owner = std::make_unique<SegmentationOwner>();
+        erb::ImageSource src = load();
+        if (!src.empty()) owner->data = segmentator->Segment(src, outputs & erb::NORMALIZED_ALL);
+
+        auto& normalized = owner->data.irisNormalized;
+        // The eye crop may be a view over the caller buffer, the result must not depend on it
+        if (normalized.eye.data && !normalized.eye.u) normalized.eye = normalized.eye.clone();
+        // The eye mask is computed on first use, here where its errors are caught
+        normalized.eyeMask();
+    }
+    catch (const std::exception& e)
+    {
+        LOG("Segmentation error: " << e.what());
+        if (owner) owner->data = {};
+    }
+    catch (...)
+    {
+        LOG("Segmentation error");
+        if (owner) owner->data = {};
+    }
+    if (!owner) return &failedSegmentation;
+
+    const auto& normalized = owner->data.irisNormalized;
+    const auto& iris = owner->data.iris;
+    auto& view = owner->view;
+    view.handle = owner.get();
+    view.valid = iris.isValid();
+    view.pupil[0] = iris.pupil.center[0]; view.pupil[1] = iris.pupil.center[1]; view.pupil[2] = iris.pupil.radius;
+    view.limbus[0] = iris.limbus.center[0]; view.limbus[1] = iris.limbus.center[1]; view.limbus[2] = iris.limbus.radius;
+    view.eye = imageView(normalized.eye);
+    view.irisNormalized = imageView(normalized.irisNormalized);
+    view.eyeMask = imageView(normalized.eyeMask());
+    view.irisNormalizedMask = imageView(normalized.irisNormalizedMask);
+    return &owner.release()->view;
+}
+}
+
+void* erb_segmentator_create(const char* method, int32_t scaleSize, int32_t normWidth, int32_t normHeight, int32_t sampling, const char* cascadePath)
+{
+    std::string name = method ? method : "hough";
+    if (name != "hough" && name != "isis") return nullptr;
+
+    auto eyeDetector = std::make_shared<const erb::EyeDetector>(cascadePath ? cascadePath : erb::DEFAULT_EYE_CASCADE);
+    erb::Segmentator* segmentator = nullptr;
+    if (name == "hough") segmentator = new hough::HoughSegmentator(scaleSize, eyeDetector);
+    else segmentator = new isis::IsisSegmentator(scaleSize, eyeDetector);
+
+    erb::NormalizationParams params;
+    params.size = cv::Size(normWidth, normHeight);
+    params.sampling = static_cast<erb::NormalizationSampling>(sampling);
+    segmentator->setNormalizationParams(params);
+    return segmentator;
+}
+
+void erb_segmentator_destroy(void* segmentator)
+{
+    delete static_cast<erb::Segmentator*>(segmentator);
+}
+
+ErbSegmentation* erb_segment(void* segmentator, const uint8_t* data, int32_t rows, int32_t cols, int64_t step, int32_t outputs)
+{
+    return segment(static_cast<const erb::Segmentator*>(segmentator), [&]() {
+        return erb::ImageSource(cv::Mat(rows, cols, CV_8UC3, const_cast<uint8_t*>(data), (size_t)step));
+    }, outputs);
+}
+
+ErbSegmentation* erb_segment_file(void* segmentator, const char* path, int32_t outputs)
+{
+    auto instance = static_cast<const erb::Segmentator*>(segmentator);
+    return segment(instance, [&]() { return erb::ImageSource::read(path, instance->searchSize()); }, outputs);
+}
+
+void erb_segmentation_free(ErbSegmentation* segmentation)
+{
+    if (segmentation) delete static_cast<SegmentationOwner*>(segmentation->handle);
+}
+
+void erb_set_execution(int32_t backend, int32_t threads)
+{
+    erb::setExecutionBackend(static_cast<erb::ExecutionBackend>(std::clamp(backend, 0, 2)), threads);
+}
+
+void* erb_store_open(const char* path, int32_t dim)
+{
+    auto store = new erb::TemplateStore(path, dim);
+    if (store->isOpen()) return store;
+    delete store;
+    return nullptr;
+}
+
+void erb_store_close(void* store)
+{
+    delete static_cast<erb::TemplateStore*>(store);
+}
+
+int32_t erb_store_append(void* store, int64_t identity, const float* features)
+{
+    return static_cast<erb::TemplateStore*>(store)->append(identity, features);
+}
+
+int64_t erb_store_size(void* store)
+{
+    return static_cast<erb::TemplateStore*>(store)->size();
+}
+
+int32_t erb_store_dim(void* store)
+{
+    return static_cast<erb::TemplateStore*>(store)->dim();
+}
+
+const uint8_t* erb_store_data(void* store)
+{
+    auto templates = static_cast<erb::TemplateStore*>(store);
+    return templates->size() > 0 ? reinterpret_cast<const uint8_t*>(templates->features(0)) - erb::TemplateStore::ALIGNMENT : nullptr;
+}
+
+int64_t erb_store_record_size(void* store)
+{
+    return static_cast<erb::TemplateStore*>(store)->recordSize();
+}
+
+int64_t erb_store_templates_of(void* store, int64_t identity, int64_t* out, int64_t maxCount)
+{
+    const auto& templates = static_cast<erb::TemplateStore*>(store)->templatesOf(identity);
+    for (int64_t i = 0; i < std::min<int64_t>(maxCount, templates.size()); i++) out[i] = templates[i];
+    return templates.size();
+}
+
+int64_t erb_identify(void* store, const float* probe, int64_t maxRank, float threshold, int32_t threads,
+    float* distances, int64_t* identities)
+{
+    if (maxRank <= 0) return 0;
+    if (threshold < 0) threshold = std::numeric_limits<float>::infinity();
+    auto matches = erb::identify(*static_cast<erb::TemplateStore*>(store), probe, maxRank, threshold, threads);
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+        distances[i] = matches[i].distance;
+        identities[i] = matches[i].identity;
+    }
+    return matches.size();
+}
@@ -0,0 +1,119 @@
+#ifndef __SEGMENTATORC_H_
+#define __SEGMENTATORC_H_
+
+// C interface of the segmentation library, used by the Python demo through ctypes
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define ERB_API __declspec(dllexport)
+#else
+#define ERB_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// View over an 8-bit image owned by the library
+typedef struct ErbImage
+{
+    uint8_t* data;
+    int32_t rows;
+    int32_t cols;
+    int32_t channels;
+    // bytes between two rows
+    int64_t step;
+} ErbImage;
+
+// Segmentation result, images stay valid until erb_segmentation_free
+typedef struct ErbSegmentation
+{
+    int32_t valid;
+    // center x, center y, radius
+    int32_t pupil[3];
+    int32_t limbus[3];
+    ErbImage eye;
+    ErbImage irisNormalized;
+    ErbImage eyeMask;
+    ErbImage irisNormalizedMask;
+    // internal data
+    void* handle;
+} ErbSegmentation;
+
+/*
+* Create a segmentator
+* @param method: "hough" or "isis"
+* @param scaleSize: image scale size
+* @param normWidth, normHeight: normalized iris size, 0 for the native size
+* @param sampling: normalized iris sampling (0 nearest, 1 bilinear, 2 area)
+* @param cascadePath: eye cascade file
+* @return segmentator handle, null if method is unknown
+*/
+ERB_API void* erb_segmentator_create(const char* method, int32_t scaleSize, int32_t normWidth, int32_t normHeight, int32_t sampling, const char* cascadePath);
+ERB_API void erb_segmentator_destroy(void* segmentator);
+
+/*
+* Segment a BGR image, the input buffer is not copied. Can be called from many threads on the same segmentator
+* @param segmentator: segmentator handle
+* @param data: image pixels, 8-bit BGR
+* @param rows, cols: image size
+* @param step: bytes between two rows
+* @param outputs: images to produce, bitmask of 1 irisNormalized, 2 irisNormalizedMask, 4 eyeMask, 8 eye; others are empty
+* @return segmentation result (not valid on errors, never null), to release with erb_segmentation_free
+*/
+ERB_API ErbSegmentation* erb_segment(void* segmentator, const uint8_t* data, int32_t rows, int32_t cols, int64_t step, int32_t outputs);
+/*
+* Read and segment an image file. JPEG files are decoded at the resolution of the circles search, only the eye crop at full resolution
+* @param segmentator: segmentator handle
+* @param path: image path
+* @param outputs: images to produce, as in erb_segment
+* @return segmentation result (not valid if the file cannot be read), to release with erb_segmentation_free
+*/
+ERB_API ErbSegmentation* erb_segment_file(void* segmentator, const char* path, int32_t outputs);
+ERB_API void erb_segmentation_free(ErbSegmentation* segmentation);
+/*
+* Select how a segmentation runs its parallel loops, for the whole process
+* @param backend: 0 serial, 1 thread pool, 2 std::execution::par
+* @param threads: threads used by one segmentation, 0 for every core
+*/
+ERB_API void erb_set_execution(int32_t backend, int32_t threads);
+
+/*
+* Open a template store, creating it if it doesn't exist
+* @param path: store file
+* @param dim: number of features of each template, 0 to take it from an existing file
+* @return store handle, null on error
+*/
+ERB_API void* erb_store_open(const char* path, int32_t dim);
+ERB_API void erb_store_close(void* store);
+// Append a template, returns 0 on error. Pointers returned by erb_store_data are invalidated
+ERB_API int32_t erb_store_append(void* store, int64_t identity, const float* features);
+ERB_API int64_t erb_store_size(void* store);
+ERB_API int32_t erb_store_dim(void* store);
+// First record, each record is an int64 identity at offset 0 and dim floats at offset 64
+ERB_API const uint8_t* erb_store_data(void* store);
+ERB_API int64_t erb_store_record_size(void* store);
+/*
+* Indices of the templates of an identity
+* @param out: output indices, at most maxCount are written
+* @return number of templates of the identity
+*/
+ERB_API int64_t erb_store_templates_of(void* store, int64_t identity, int64_t* out, int64_t maxCount);
+/*
+* 1:N identification of a probe against every template of the store
+* @param probe: erb_store_dim features
+* @param maxRank: maximum number of matches
+* @param threshold: only templates closer than this are returned, negative for no threshold
+* @param threads: max shards scanned in parallel on the erb_set_execution backend, 0 for its thread count
+* @param distances, identities: output matches sorted by distance, at least maxRank entries
+* @return number of matches
+*/
+ERB_API int64_t erb_identify(void* store, const float* probe, int64_t maxRank, float threshold, int32_t threads,
+    float* distances, int64_t* identities);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // !__SEGMENTATORC_H_
@@ -0,0 +1,215 @@
+#include "Execution.h"
+#include "Util.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+
+#if defined(USE_PARALLEL_ALGORITHMS) && __has_include(<execution>)
+#include <execution>
+#define ERB_STD_PARALLEL
+#endif
+
+namespace erb
+{
+
+/*
+* Pool of worker threads running chunked loops.
+* Idle workers take chunks from the oldest running loop, and the calling thread
+* runs chunks of its own loop too, so nested loops never wait for a free worker.
+*/
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads)
+    {
+        // The caller is one of the threads
+        for (int i = 1; i < threads; i++) mWorkers.emplace_back([this]() { work(); });
+    }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mWake.notify_all();
+        for (auto& worker : mWorkers) worker.join();
+    }
+    inline int size() const { return static_cast<int>(mWorkers.size()) + 1; }
+
+    void run(size_t chunks, const std::function<void(size_t)>& body)
+    {
+        auto job = std::make_shared<Job>(body, chunks);
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mJobs.push_back(job);
+        }
+        mWake.notify_all();
+
+        runChunks(*job);
+        {
+            // Every chunk is taken, wait for the ones run by workers
+            std::unique_lock<std::mutex> lock(mMutex);
+            mJobs.erase(std::remove(mJobs.begin(), mJobs.end(), job), mJobs.end());
+            mDone.wait(lock, [&]() { return job->done == job->chunks; });
+        }
+        if (job->error) std::rethrow_exception(job->error);
+    }
+private:
+    struct Job
+    {
+        Job(const std::function<void(size_t)>& body, size_t chunks) : body(body), chunks(chunks) {}
+        const std::function<void(size_t)>& body;
+        const size_t chunks;
+        std::atomic<size_t> next = 0;
+        std::atomic<size_t> done = 0;
+        // Guarded by the pool mutex
+        std::exception_ptr error;
+    };
+
+    void runChunks(Job& job)
+    {
+        for (size_t chunk = job.next++; chunk < job.chunks; chunk = job.next++)
+        {
+            try
+            {
+                job.body(chunk);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                if (!job.error) job.error = std::current_exception();
+            }
+            // Only the last chunk takes the mutex, so that the caller can't miss the notification
+            if (++job.done == job.chunks)
+            {
+                std::lock_guard<std::mutex> lock(mMutex);
+                mDone.notify_all();
+            }
+        }
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true)
+        {
+            mWake.wait(lock, [&]() { return mStop || !mJobs.empty(); });
+            if (mStop) return;
+            auto job = mJobs.front();
+            if (job->next >= job->chunks)
+            {
+                // Nothing left to take, its caller will remove it
+                mJobs.pop_front();
+                continue;
+            }
+            lock.unlock();
+            runChunks(*job);
+            lock.lock();
+        }
+    }
+private:
+    std::vector<std::thread> mWorkers;
+    std::deque<std::shared_ptr<Job>> mJobs;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::condition_variable mDone;
+    bool mStop = false;
+};
+
+// Current backend, the pool is replaced when the backend changes
+static std::mutex backendMutex;
+static ExecutionBackend currentBackend = ExecutionBackend::SERIAL;
+static std::shared_ptr<ThreadPool> currentPool;
+static int currentThreads = 1;
+
+void setExecutionBackend(ExecutionBackend backend, int threads)
+{
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+#ifndef ERB_STD_PARALLEL
+    if (backend == ExecutionBackend::STD_PARALLEL)
+    {
+        LOG("std::execution::par is not available, using the thread pool");
+        backend = ExecutionBackend::POOL;
+    }
+#endif
+    if (backend == ExecutionBackend::SERIAL || threads == 1)
+    {
+        backend = ExecutionBackend::SERIAL;
+        threads = 1;
+    }
+
+    std::lock_guard<std::mutex> lock(backendMutex);
+    currentBackend = backend;
+    currentThreads = threads;
+    // Loops already running keep the old pool alive until they end
+    currentPool = backend == ExecutionBackend::POOL ? std::make_shared<ThreadPool>(threads) : nullptr;
+}
+
+ExecutionBackend executionBackend()
+{
+    std::lock_guard<std::mutex> lock(backendMutex);
+    return currentBackend;
+}
+
+int executionThreads()
+{
+    std::lock_guard<std::mutex> lock(backendMutex);
+    return currentThreads;
+}
+
+void parallelChunks(size_t count, size_t chunks, const std::function<void(size_t, size_t, size_t)>& body)
+{
+    chunks = std::min(count, chunks);
+    if (chunks == 0) return;
+    auto chunkBody = [&](size_t chunk) { body(chunk * count / chunks, (chunk + 1) * count / chunks, chunk); };
+
+    ExecutionBackend backend;
+    std::shared_ptr<ThreadPool> pool;
+    {
+        std::lock_guard<std::mutex> lock(backendMutex);
+        backend = currentBackend;
+        pool = currentPool;
+    }
+    if (chunks == 1) backend = ExecutionBackend::SERIAL;
+
+    switch (backend)
+    {
+    case ExecutionBackend::POOL:
+        pool->run(chunks, chunkBody);
+        break;
+#ifdef ERB_STD_PARALLEL
+    case ExecutionBackend::STD_PARALLEL:
+    {
+        std::vector<size_t> indices(chunks);
+        std::iota(indices.begin(), indices.end(), size_t(0));
+        // An exception leaving a parallel algorithm terminates the program, rethrow the first one here
+        std::mutex errorMutex;
+        std::exception_ptr error;
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](size_t chunk) {
+            try
+            {
+                chunkBody(chunk);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) error = std::current_exception();
+            }
+        });
+        if (error) std::rethrow_exception(error);
+    }
+        break;
+#endif
+    default:
+        for (size_t chunk = 0; chunk < chunks; chunk++) chunkBody(chunk);
+        break;
+    }
+}
+
+}
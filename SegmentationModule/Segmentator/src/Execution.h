@@ -0,0 +1,67 @@
+#ifndef __EXECUTION_H_
+#define __EXECUTION_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace erb
+{
+
+// How the segmentators run their parallel loops
+enum struct ExecutionBackend { SERIAL, POOL, STD_PARALLEL };
+
+/*
+* Select the execution backend, for the whole process
+* @param backend: SERIAL, internal thread pool or std::execution::par (pool if not available)
+* @param threads: pool size, 0 for every core
+*/
+void setExecutionBackend(ExecutionBackend backend, int threads = 0);
+ExecutionBackend executionBackend();
+// Number of threads running a parallel loop (1 for SERIAL)
+int executionThreads();
+
+/*
+* Split [0, count) in chunks and run them on the current backend
+* @param count: number of indices
+* @param chunks: number of chunks, each covers a contiguous range
+* @param body: called as body(begin, end, chunk) once per chunk
+*/
+void parallelChunks(size_t count, size_t chunks, const std::function<void(size_t, size_t, size_t)>& body);
+
+// A few chunks per thread balance uneven indices without paying a chunk per index
+inline size_t defaultChunks(size_t count)
+{
+    return std::min(count, static_cast<size_t>(executionThreads()) * 4);
+}
+
+/*
+* Run body(i) for every i in [0, count) on the current backend
+*/
+inline void parallelFor(size_t count, const std::function<void(size_t)>& body)
+{
+    parallelChunks(count, defaultChunks(count), [&](size_t begin, size_t end, size_t) { for (size_t i = begin; i < end; i++) body(i); });
+}
+
+/*
+* Collect results over [0, count) on the current backend.
+* Each chunk pushes in its own buffer and the buffers are merged at the end,
+* so results are in index order whatever the backend
+* @param fn: called as fn(i, out) for every index, pushes its results in out
+*/
+template<typename T, typename F>
+std::vector<T> parallelCollect(size_t count, F&& fn)
+{
+    size_t chunks = defaultChunks(count);
+    std::vector<std::vector<T>> buffers(chunks);
+    parallelChunks(count, chunks, [&](size_t begin, size_t end, size_t chunk) {
+        for (size_t i = begin; i < end; i++) fn(i, buffers[chunk]);
+    });
+    std::vector<T> result;
+    for (auto& buffer : buffers) result.insert(result.end(), buffer.begin(), buffer.end());
+    return result;
+}
+
+}
+#endif // !__EXECUTION_H_
@@ -0,0 +1,82 @@
+#include "EyeDetector.h"
+#include "Util.h"
+
+#include <opencv2/core.hpp>
+#include <fstream>
+#include <sstream>
+
+namespace erb
+{
+
+EyeDetector::EyeDetector(const std::string& cascadePath)
+{
+    std::ifstream file(cascadePath, std::ios::in | std::ios::binary);
+    if (!file)
+    {
+        LOG("Cannot open eye cascade: " << cascadePath);
+        return;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    mCascade = buffer.str();
+
+    // The first classifier of the pool, this also validates the cascade
+    auto classifier = parseClassifier();
+    if (classifier->empty())
+    {
+        LOG("Invalid eye cascade: " << cascadePath);
+        mCascade.clear();
+        return;
+    }
+    mIdle.push_back(std::move(classifier));
+}
+
+std::unique_ptr<cv::CascadeClassifier> EyeDetector::parseClassifier() const
+{
+    auto classifier = std::make_unique<cv::CascadeClassifier>();
+    cv::FileStorage fs(mCascade, cv::FileStorage::READ | cv::FileStorage::MEMORY);
+    if (fs.isOpened())
+        classifier->read(fs.getFirstTopLevelNode());
+    return classifier;
+}
+
+std::unique_ptr<cv::CascadeClassifier> EyeDetector::acquireClassifier() const
+{
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+        if (!mIdle.empty())
+        {
+            auto classifier = std::move(mIdle.back());
+            mIdle.pop_back();
+            return classifier;
+        }
+    }
+    // Parsed outside the lock, other threads keep detecting meanwhile
+    return parseClassifier();
+}
+
+void EyeDetector::releaseClassifier(std::unique_ptr<cv::CascadeClassifier> classifier) const
+{
+    std::lock_guard<std::mutex> guard(mMutex);
+    mIdle.push_back(std::move(classifier));
+}
+
+std::vector<cv::Rect> EyeDetector::detect(const cv::Mat& src) const
+{
+    auto eyes = std::vector<cv::Rect>();
+    if (!isLoaded()) return eyes;
+    auto classifier = acquireClassifier();
+    try
+    {
+        classifier->detectMultiScale(src, eyes, 1.1, 3, 0, cv::Size(), src.size());
+    }
+    catch (...)
+    {
+        releaseClassifier(std::move(classifier));
+        throw;
+    }
+    releaseClassifier(std::move(classifier));
+    return eyes;
+}
+
+}
@@ -0,0 +1,63 @@
+#ifndef __EYEDETECTOR_H_
+#define __EYEDETECTOR_H_
+
+#include <opencv2/objdetect.hpp>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace erb
+{
+
+// Haar cascade file used for eye detection
+constexpr const char* DEFAULT_EYE_CASCADE = "haarcascade_eye_tree_eyeglasses.xml";
+
+/*
+* Eye detector based on an Haar Cascade classifier.
+* The cascade file is read only once. Concurrent detect() calls borrow a classifier from a pool
+* built from the in-memory cascade, so a single detector can be shared between segmentators and
+* worker threads, and it never holds more classifiers than the most concurrent detections so far.
+*/
+class EyeDetector
+{
+public:
+    /*
+    * Load the cascade classifier
+    * @param cascadePath: path to the cascade xml file
+    */
+    explicit EyeDetector(const std::string& cascadePath = DEFAULT_EYE_CASCADE);
+    EyeDetector(const EyeDetector&) = delete;
+    EyeDetector& operator=(const EyeDetector&) = delete;
+
+    /*
+    * Tells if the cascade has been loaded
+    * @return true if detect() can be used
+    */
+    inline bool isLoaded() const { return !mCascade.empty(); }
+
+    /*
+    * Find all possible ROIs of an eye in an image
+    * @param src: input image
+    * @return list of candidates ROIs
+    */
+    std::vector<cv::Rect> detect(const cv::Mat& src) const;
+private:
+    // Build a classifier from the in-memory cascade
+    std::unique_ptr<cv::CascadeClassifier> parseClassifier() const;
+    // Take an idle classifier from the pool, a new one is built if they are all in use
+    std::unique_ptr<cv::CascadeClassifier> acquireClassifier() const;
+    // Give a classifier back to the pool
+    void releaseClassifier(std::unique_ptr<cv::CascadeClassifier> classifier) const;
+private:
+    // Cascade xml content, parsed again only when every classifier is in use
+    std::string mCascade;
+
+    mutable std::mutex mMutex;
+    // Classifiers not in use
+    mutable std::vector<std::unique_ptr<cv::CascadeClassifier>> mIdle;
+};
+
+}
+#endif // !__EYEDETECTOR_H_
@@ -0,0 +1,206 @@
+#include "Gallery/Identification.h"
+#include "Execution.h"
+
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ERB_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace erb
+{
+
+// Templates compared together, so every probe chunk is loaded once per block
+constexpr size_t DISTANCE_BLOCK = 4;
+// Below this number of templates per thread, threads are not worth it
+constexpr size_t MIN_TEMPLATES_PER_THREAD = 1024;
+
+// Squared distances between probe and DISTANCE_BLOCK templates.
+// Features are float but sums are double, as in the scipy pdist the demo used
+using BlockDistanceFn = void (*)(const float* probe, const float* const* templates, size_t dim, double* out);
+
+void blockDistanceScalar(const float* probe, const float* const* templates, size_t dim, double* out)
+{
+    for (size_t t = 0; t < DISTANCE_BLOCK; t++)
+    {
+        double sum = 0;
+        for (size_t i = 0; i < dim; i++)
+        {
+            double d = static_cast<double>(probe[i]) - templates[t][i];
+            sum += d * d;
+        }
+        out[t] = sum;
+    }
+}
+
+#ifdef ERB_X86_SIMD
+
+__attribute__((target("avx2,fma")))
+inline double horizontalSum(__m256d v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    s = _mm_add_sd(s, _mm_unpackhi_pd(s, s));
+    return _mm_cvtsd_f64(s);
+}
+
+__attribute__((target("avx2,fma")))
+void blockDistanceAvx2(const float* probe, const float* const* templates, size_t dim, double* out)
+{
+    __m256d acc[DISTANCE_BLOCK];
+    for (size_t t = 0; t < DISTANCE_BLOCK; t++) acc[t] = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= dim; i += 4)
+    {
+        __m256d p = _mm256_cvtps_pd(_mm_loadu_ps(probe + i));
+        for (size_t t = 0; t < DISTANCE_BLOCK; t++)
+        {
+            __m256d d = _mm256_sub_pd(p, _mm256_cvtps_pd(_mm_loadu_ps(templates[t] + i)));
+            acc[t] = _mm256_fmadd_pd(d, d, acc[t]);
+        }
+    }
+    for (size_t t = 0; t < DISTANCE_BLOCK; t++)
+    {
+        double sum = horizontalSum(acc[t]);
+        for (size_t j = i; j < dim; j++)
+        {
+            double d = static_cast<double>(probe[j]) - templates[t][j];
+            sum += d * d;
+        }
+        out[t] = sum;
+    }
+}
+
+__attribute__((target("avx512f")))
+void blockDistanceAvx512(const float* probe, const float* const* templates, size_t dim, double* out)
+{
+    __m512d acc[DISTANCE_BLOCK];
+    for (size_t t = 0; t < DISTANCE_BLOCK; t++) acc[t] = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= dim; i += 8)
+    {
+        __m512d p = _mm512_cvtps_pd(_mm256_loadu_ps(probe + i));
+        for (size_t t = 0; t < DISTANCE_BLOCK; t++)
+        {
+            __m512d d = _mm512_sub_pd(p, _mm512_cvtps_pd(_mm256_loadu_ps(templates[t] + i)));
+            acc[t] = _mm512_fmadd_pd(d, d, acc[t]);
+        }
+    }
+    for (size_t t = 0; t < DISTANCE_BLOCK; t++)
+    {
+        double sum = _mm512_reduce_add_pd(acc[t]);
+        for (size_t j = i; j < dim; j++)
+        {
+            double d = static_cast<double>(probe[j]) - templates[t][j];
+            sum += d * d;
+        }
+        out[t] = sum;
+    }
+}
+
+#endif
+
+// Best kernel for this cpu, chosen once
+BlockDistanceFn blockDistance()
+{
+    static const BlockDistanceFn fn = []() -> BlockDistanceFn {
+#ifdef ERB_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return blockDistanceAvx512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return blockDistanceAvx2;
+#endif
+        return blockDistanceScalar;
+    }();
+    return fn;
+}
+
+double squaredDistance(const float* a, const float* b, size_t dim)
+{
+    const float* templates[DISTANCE_BLOCK] = { b, b, b, b };
+    double out[DISTANCE_BLOCK];
+    blockDistance()(a, templates, dim, out);
+    return out[0];
+}
+
+// A template found by a shard, before the merge
+struct Candidate
+{
+    double distance;
+    size_t index;
+};
+
+// Compare is a max-heap on (distance, index), so the top is the worst of the best k
+struct FartherCandidate
+{
+    inline bool operator()(const Candidate& a, const Candidate& b) const
+    {
+        return a.distance < b.distance || (a.distance == b.distance && a.index < b.index);
+    }
+};
+using CandidateHeap = std::priority_queue<Candidate, std::vector<Candidate>, FartherCandidate>;
+
+// Scan templates [begin, end), keeping the k closest (squared distances) in heap
+void scanShard(const TemplateStore& store, const float* probe, size_t begin, size_t end, size_t k, double squaredThreshold, CandidateHeap& heap)
+{
+    auto kernel = blockDistance();
+    size_t dim = store.dim();
+    const float* templates[DISTANCE_BLOCK];
+    double distances[DISTANCE_BLOCK];
+    for (size_t i = begin; i < end; i += DISTANCE_BLOCK)
+    {
+        size_t count = std::min(DISTANCE_BLOCK, end - i);
+        // An incomplete last block repeats its first template
+        for (size_t t = 0; t < DISTANCE_BLOCK; t++) templates[t] = store.features(i + (t < count ? t : 0));
+        kernel(probe, templates, dim, distances);
+
+        for (size_t t = 0; t < count; t++)
+        {
+            double d = distances[t];
+            if (!(d < squaredThreshold)) continue;
+            if (heap.size() < k) heap.push({ d, i + t });
+            else if (d < heap.top().distance)
+            {
+                heap.pop();
+                heap.push({ d, i + t });
+            }
+        }
+    }
+}
+
+std::vector<Match> identify(const TemplateStore& store, const float* probe, size_t maxRank, float threshold, int threads)
+{
+    std::vector<Match> matches;
+    size_t n = store.size();
+    if (maxRank == 0 || n == 0) return matches;
+
+    double squaredThreshold = static_cast<double>(threshold) * threshold;
+    size_t shards = threads > 0 ? threads : executionThreads();
+    shards = std::max<size_t>(1, std::min(shards, n / MIN_TEMPLATES_PER_THREAD));
+
+    // Shards run on the execution backend, each with its own heap
+    auto heaps = std::vector<CandidateHeap>(shards);
+    parallelChunks(n, shards, [&](size_t begin, size_t end, size_t shard) {
+        scanShard(store, probe, begin, end, maxRank, squaredThreshold, heaps[shard]);
+    });
+
+    std::vector<Candidate> candidates;
+    for (auto& heap : heaps)
+    {
+        while (!heap.empty())
+        {
+            candidates.push_back({ std::sqrt(heap.top().distance), heap.top().index });
+            heap.pop();
+        }
+    }
+    // Same order as a stable sort of the templates by distance: ties by template index
+    std::sort(candidates.begin(), candidates.end(), FartherCandidate());
+    if (candidates.size() > maxRank) candidates.resize(maxRank);
+    // Squared rounding may let a match at the threshold through
+    while (!candidates.empty() && !(candidates.back().distance < threshold)) candidates.pop_back();
+    for (auto& c : candidates) matches.push_back({ static_cast<float>(c.distance), store.identity(c.index), c.index });
+    return matches;
+}
+
+}
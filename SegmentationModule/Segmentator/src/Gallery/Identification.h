@@ -0,0 +1,47 @@
+#ifndef __IDENTIFICATION_H_
+#define __IDENTIFICATION_H_
+
+#include "Gallery/TemplateStore.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace erb
+{
+
+// A gallery template matching a probe
+struct Match
+{
+    // Euclidean distance between probe and template, computed in double
+    float distance;
+    int64_t identity;
+    // Template index in the store
+    size_t index;
+};
+
+/*
+* Squared euclidean distance between two feature vectors, summed in double (AVX-512/AVX2 when the cpu supports them)
+* @param a, b: feature vectors
+* @param dim: number of features
+*/
+double squaredDistance(const float* a, const float* b, size_t dim);
+
+/*
+* 1:N identification: compare the probe with every gallery template
+* @param store: gallery
+* @param probe: store.dim() features
+* @param maxRank: number of matches returned
+* @param threshold: only templates closer than this are returned
+* @param threads: max number of shards scanned in parallel on the execution backend, 0 for its thread count
+* @return the maxRank closest templates, sorted by distance then by template index.
+* The SIMD kernels sum in a different order than a sequential loop, so a distance may
+* differ from the scipy one in the last ulp and two templates that tie there may swap
+*/
+std::vector<Match> identify(const TemplateStore& store, const float* probe, size_t maxRank,
+    float threshold = std::numeric_limits<float>::infinity(), int threads = 0);
+
+}
+
+#endif // !__IDENTIFICATION_H_
@@ -0,0 +1,196 @@
+#include "Gallery/TemplateStore.h"
+#include "Util.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace erb
+{
+
+static const char TEMPLATE_STORE_MAGIC[8] = { 'E', 'R', 'B', 'T', 'P', 'L', '\0', '\0' };
+
+TemplateStore::TemplateStore(const std::string& path, uint32_t dim) : mPath(path)
+{
+    TemplateStoreHeader header{};
+    if (std::filesystem::exists(path))
+    {
+        // An existing file that isn't a store is left as is
+        std::ifstream in(path, std::ios::binary);
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        {
+            LOG("Cannot read template store header: " << path);
+            return;
+        }
+        if (std::memcmp(header.magic, TEMPLATE_STORE_MAGIC, sizeof(header.magic)) != 0 || header.version != VERSION)
+        {
+            LOG("Not a template store (or unsupported version): " << path);
+            return;
+        }
+        if (dim != 0 && header.dim != dim)
+        {
+            LOG("Template store " << path << " has " << header.dim << " features, expected " << dim);
+            return;
+        }
+    }
+    else
+    {
+        if (dim == 0)
+        {
+            LOG("Cannot create template store without features size: " << path);
+            return;
+        }
+        // New store, only the header
+        std::memcpy(header.magic, TEMPLATE_STORE_MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        header.dim = dim;
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out.write(reinterpret_cast<const char*>(&header), sizeof(header)))
+        {
+            LOG("Cannot create template store: " << path);
+            return;
+        }
+    }
+    mDim = header.dim;
+    if (!map()) mDim = 0;
+}
+
+TemplateStore::~TemplateStore()
+{
+    unmap();
+}
+
+bool TemplateStore::append(int64_t identity, const float* features)
+{
+    if (!isOpen()) return false;
+    std::vector<uint8_t> record(recordSize(), 0);
+    std::memcpy(record.data(), &identity, sizeof(identity));
+    std::memcpy(record.data() + ALIGNMENT, features, mDim * sizeof(float));
+
+    size_t count;
+    {
+        // Always append after the last complete record of the file as it is now, it may have grown since it was mapped
+        std::fstream out(mPath, std::ios::binary | std::ios::in | std::ios::out);
+        out.seekg(0, std::ios::end);
+        auto fileSize = static_cast<std::streamoff>(out.tellg());
+        if (!out || fileSize < static_cast<std::streamoff>(sizeof(TemplateStoreHeader)))
+        {
+            LOG("Cannot append to template store: " << mPath);
+            return false;
+        }
+        count = (fileSize - sizeof(TemplateStoreHeader)) / recordSize();
+        out.seekp(sizeof(TemplateStoreHeader) + count * recordSize());
+        if (!out.write(reinterpret_cast<const char*>(record.data()), record.size()) || !out.flush())
+        {
+            LOG("Cannot append to template store: " << mPath);
+            return false;
+        }
+    }
+
+    // Templates appended by another writer are not in the index yet
+    if (mIndexed && count == mSize) mIndex[identity].push_back(count);
+    else
+    {
+        mIndex.clear();
+        mIndexed = false;
+    }
+    unmap();
+    return map();
+}
+
+const std::vector<size_t>& TemplateStore::templatesOf(int64_t identity) const
+{
+    static const std::vector<size_t> empty;
+    if (!mIndexed)
+    {
+        for (size_t i = 0; i < mSize; i++) mIndex[this->identity(i)].push_back(i);
+        mIndexed = true;
+    }
+    auto it = mIndex.find(identity);
+    return it != mIndex.end() ? it->second : empty;
+}
+
+bool TemplateStore::checkMapping()
+{
+    // The file may have been cut or replaced since the header was read
+    const auto* header = reinterpret_cast<const TemplateStoreHeader*>(mData);
+    if (mMappedSize < sizeof(TemplateStoreHeader) || std::memcmp(header->magic, TEMPLATE_STORE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != VERSION || header->dim != mDim)
+    {
+        LOG("Invalid template store: " << mPath);
+        unmap();
+        return false;
+    }
+    mSize = (mMappedSize - sizeof(TemplateStoreHeader)) / recordSize();
+    return true;
+}
+
+#if !defined(_WIN32)
+
+bool TemplateStore::map()
+{
+    int fd = ::open(mPath.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) < 0)
+    {
+        LOG("Cannot open template store: " << mPath);
+        if (fd >= 0) ::close(fd);
+        return false;
+    }
+    mMappedSize = static_cast<size_t>(st.st_size);
+    void* data = ::mmap(nullptr, mMappedSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        LOG("Cannot map template store: " << mPath);
+        mMappedSize = 0;
+        return false;
+    }
+    mData = static_cast<const uint8_t*>(data);
+    return checkMapping();
+}
+
+void TemplateStore::unmap()
+{
+    if (mData) ::munmap(const_cast<uint8_t*>(mData), mMappedSize);
+    mData = nullptr;
+    mMappedSize = 0;
+    mSize = 0;
+}
+
+#else
+
+bool TemplateStore::map()
+{
+    std::ifstream in(mPath, std::ios::binary | std::ios::ate);
+    if (!in)
+    {
+        LOG("Cannot open template store: " << mPath);
+        return false;
+    }
+    mBuffer.resize(static_cast<size_t>(in.tellg()));
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(mBuffer.data()), mBuffer.size());
+    mData = mBuffer.data();
+    mMappedSize = mBuffer.size();
+    return checkMapping();
+}
+
+void TemplateStore::unmap()
+{
+    mBuffer.clear();
+    mData = nullptr;
+    mMappedSize = 0;
+    mSize = 0;
+}
+
+#endif
+
+}
@@ -0,0 +1,99 @@
+#ifndef __TEMPLATESTORE_H_
+#define __TEMPLATESTORE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace erb
+{
+
+/*
+* File layout (native byte order), every block is 64-byte aligned:
+* header: TemplateStoreHeader (64 bytes)
+* records: [identity (int64) + padding to 64 bytes][dim float features, padded to 64 bytes] ...
+* The number of templates is derived from the file size, so appending a template is a single write
+* and a record cut by a crash is ignored.
+*/
+struct TemplateStoreHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint8_t reserved[48];
+};
+static_assert(sizeof(TemplateStoreHeader) == 64, "Template store header must be 64 bytes");
+
+// Append-only gallery of feature templates, memory mapped
+class TemplateStore
+{
+public:
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t ALIGNMENT = 64;
+
+    /*
+    * Open a store, creating it if the file doesn't exist.
+    * An existing file that is not a valid store is never modified, isOpen() is false
+    * @param path: store file
+    * @param dim: number of features of each template, 0 to take it from an existing file
+    */
+    TemplateStore(const std::string& path, uint32_t dim = 0);
+    ~TemplateStore();
+    TemplateStore(const TemplateStore&) = delete;
+    TemplateStore& operator=(const TemplateStore&) = delete;
+
+    inline bool isOpen() const { return mDim > 0; }
+    inline uint32_t dim() const { return mDim; }
+    // Number of templates
+    inline size_t size() const { return mSize; }
+    // Bytes between two consecutive templates
+    inline size_t recordSize() const { return ALIGNMENT + featuresSize(); }
+
+    inline int64_t identity(size_t i) const { return *reinterpret_cast<const int64_t*>(record(i)); }
+    inline const float* features(size_t i) const { return reinterpret_cast<const float*>(record(i) + ALIGNMENT); }
+
+    /*
+    * Append a template (not thread safe, pointers returned by features() are invalidated).
+    * The template goes after the last complete record of the file, including the ones appended
+    * by other stores since this one was mapped; appends themselves must come from a single process
+    * @param identity: template label
+    * @param features: dim() features
+    * @return true if the template has been written
+    */
+    bool append(int64_t identity, const float* features);
+
+    /*
+    * Templates of an identity, the index is built on first use
+    * @param identity: template label
+    * @return indices of the templates
+    */
+    const std::vector<size_t>& templatesOf(int64_t identity) const;
+private:
+    inline size_t featuresSize() const { return (mDim * sizeof(float) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+    inline const uint8_t* record(size_t i) const { return mData + sizeof(TemplateStoreHeader) + i * recordSize(); }
+    // Map the whole file, returns false on error
+    bool map();
+    // Check the header of the mapped file and count its templates, unmaps it if invalid
+    bool checkMapping();
+    void unmap();
+private:
+    std::string mPath;
+    uint32_t mDim = 0;
+    size_t mSize = 0;
+
+    const uint8_t* mData = nullptr;
+    size_t mMappedSize = 0;
+#if defined(_WIN32)
+    // No mmap on windows, the file is read in memory
+    std::vector<uint8_t> mBuffer;
+#endif
+
+    mutable bool mIndexed = false;
+    mutable std::unordered_map<int64_t, std::vector<size_t>> mIndex;
+};
+
+}
+
+#endif // !__TEMPLATESTORE_H_
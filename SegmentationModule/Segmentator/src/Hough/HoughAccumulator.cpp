@@ -0,0 +1,188 @@
+#include "Hough/HoughAccumulator.h"
+
+#include <opencv2/imgproc.hpp>
+#include <cmath>
+
+namespace hough {
+
+// Fixed point precision of the voting rays
+constexpr int VOTE_SHIFT = 10;
+constexpr int VOTE_ONE = 1 << VOTE_SHIFT;
+
+HoughAccumulator::HoughAccumulator(const cv::Mat& img, double cannyThreshold, int minVotes, int minRadius, int maxRadius)
+{
+	accumulate(img, cannyThreshold, minVotes, minRadius, maxRadius, cv::Point(), -1);
+}
+
+HoughAccumulator::HoughAccumulator(const cv::Mat& img, double cannyThreshold, int minVotes, int minRadius, int maxRadius, const cv::Point& center, int centerRange)
+{
+	accumulate(img, cannyThreshold, minVotes, minRadius, maxRadius, center, std::max(0, centerRange));
+}
+
+std::vector<cv::Vec3f> HoughAccumulator::circles(int minVotes) const
+{
+	// Candidates are sorted, the circles are a prefix
+	auto end = std::partition_point(mCandidates.begin(), mCandidates.end(), [&](const HoughCandidate& c) { return c.votes() > minVotes; });
+	std::vector<cv::Vec3f> result;
+	result.reserve(std::distance(mCandidates.begin(), end));
+	for (auto it = mCandidates.begin(); it != end; ++it)
+		result.push_back(it->circle);
+	return result;
+}
+
+void HoughAccumulator::accumulate(const cv::Mat& img, double cannyThreshold, int minVotes, int minRadius, int maxRadius, const cv::Point& center, int centerRange)
+{
+	// Same edges and gradient as cv::HoughCircles
+	cv::Mat dx, dy, edges;
+	cv::Sobel(img, dx, CV_16S, 1, 0, 3, 1, 0, cv::BORDER_REPLICATE);
+	cv::Sobel(img, dy, CV_16S, 0, 1, 3, 1, 0, cv::BORDER_REPLICATE);
+	cv::Canny(dx, dy, edges, std::max(1.0, cannyThreshold / 2), cannyThreshold);
+	accumulate(edges, dx, dy, minVotes, minRadius, maxRadius, center, centerRange);
+}
+
+void HoughAccumulator::accumulate(const cv::Mat& edges, const cv::Mat& dx, const cv::Mat& dy, int minVotes, int minRadius, int maxRadius, const cv::Point& center, int centerRange)
+{
+	mCandidates.clear();
+	int rows = edges.rows, cols = edges.cols;
+	minRadius = std::max(0, minRadius);
+	if (maxRadius <= 0) maxRadius = std::max(rows, cols);
+	else if (maxRadius <= minRadius) maxRadius = minRadius + 2;
+
+	// Image window where centers are accumulated
+	bool constrained = centerRange >= 0;
+	// Cells next to the disc get all their votes too, so that the disc maxima are the ones of an unconstrained search
+	int reach = centerRange + 1;
+	int left = 0, top = 0, right = cols, bottom = rows;
+	if (constrained)
+	{
+		left = std::max(0, center.x - centerRange);
+		top = std::max(0, center.y - centerRange);
+		right = std::min(cols, center.x + centerRange + 1);
+		bottom = std::min(rows, center.y + centerRange + 1);
+		if (left >= right || top >= bottom) return;
+	}
+
+	// Accumulator with a 1 pixel border: local maxima need no bound checks (constrained: the border holds the disc neighbours)
+	int accRows = bottom - top + 2, accCols = right - left + 2;
+	std::vector<int> accumulator(static_cast<size_t>(accRows) * accCols, 0);
+	// Edge points (structure of arrays, for the radius estimation)
+	std::vector<float> pointsX, pointsY;
+
+	for (int y = 0; y < rows; y++)
+	{
+		const uchar* edgeRow = edges.ptr<uchar>(y);
+		const short* dxRow = dx.ptr<short>(y);
+		const short* dyRow = dy.ptr<short>(y);
+		for (int x = 0; x < cols; x++)
+		{
+			int vx = dxRow[x], vy = dyRow[x];
+			if (!edgeRow[x] || (vx == 0 && vy == 0)) continue;
+
+			// A circle of radius r centered within reach of center passes within r -+ reach of it:
+			// only points in that annulus vote, and only along that part of their rays
+			int rayStart = minRadius, rayEnd = maxRadius;
+			if (constrained)
+			{
+				float distance = std::sqrt(static_cast<float>((x - center.x) * (x - center.x) + (y - center.y) * (y - center.y)));
+				rayStart = std::max(minRadius, static_cast<int>(std::floor(distance)) - reach);
+				rayEnd = std::min(maxRadius, static_cast<int>(std::ceil(distance)) + reach);
+				if (rayStart > rayEnd) continue;
+			}
+			pointsX.push_back(static_cast<float>(x));
+			pointsY.push_back(static_cast<float>(y));
+
+			// Vote along the gradient, both ways
+			float magnitude = std::sqrt(static_cast<float>(vx * vx + vy * vy));
+			int stepX = cvRound(vx * VOTE_ONE / magnitude);
+			int stepY = cvRound(vy * VOTE_ONE / magnitude);
+			// Points left of or above a constrained window have negative coordinates: multiplied, not shifted
+			int x0 = (x - left + 1) * VOTE_ONE + VOTE_ONE / 2;
+			int y0 = (y - top + 1) * VOTE_ONE + VOTE_ONE / 2;
+			for (int k = 0; k < 2; k++)
+			{
+				int x1 = x0 + rayStart * stepX, y1 = y0 + rayStart * stepY;
+				bool entered = !constrained;
+				for (int r = rayStart; r <= rayEnd; r++, x1 += stepX, y1 += stepY)
+				{
+					int x2 = x1 >> VOTE_SHIFT, y2 = y1 >> VOTE_SHIFT;
+					// The ray crosses the window once: it may still have to enter it
+					if (static_cast<unsigned>(x2) >= static_cast<unsigned>(accCols) || static_cast<unsigned>(y2) >= static_cast<unsigned>(accRows))
+					{
+						if (entered) break;
+						continue;
+					}
+					entered = true;
+					accumulator[static_cast<size_t>(y2) * accCols + x2]++;
+				}
+				stepX = -stepX;
+				stepY = -stepY;
+			}
+		}
+	}
+	if (pointsX.empty()) return;
+
+	// Centers: local maxima above minVotes
+	std::vector<std::pair<cv::Point, int>> centers;
+	for (int y = 1; y < accRows - 1; y++)
+	{
+		const int* row = accumulator.data() + static_cast<size_t>(y) * accCols;
+		for (int x = 1; x < accCols - 1; x++)
+		{
+			int v = row[x];
+			if (v > minVotes && v > row[x - 1] && v >= row[x + 1] && v > row[x - accCols] && v >= row[x + accCols])
+			{
+				cv::Point c(x - 1 + left, y - 1 + top);
+				if (constrained && (c.x - center.x) * (c.x - center.x) + (c.y - center.y) * (c.y - center.y) > centerRange * centerRange)
+					continue;
+				centers.push_back({ c, v });
+			}
+		}
+	}
+
+	// Radius of each center: the 1 pixel wide ring with most edge points for its length
+	// (integer distance bins, cv::HoughCircles slides over 0.1 pixel bins: radii and votes may differ)
+	size_t pointCount = pointsX.size();
+	std::vector<float> distances(pointCount);
+	std::vector<int> histogram(maxRadius - minRadius + 1);
+	for (const auto& [center, centerVotes] : centers)
+	{
+		float cx = static_cast<float>(center.x), cy = static_cast<float>(center.y);
+		const float* px = pointsX.data();
+		const float* py = pointsY.data();
+		float* d = distances.data();
+		// Branchless, so that it vectorizes
+		for (size_t i = 0; i < pointCount; i++)
+		{
+			float ddx = px[i] - cx, ddy = py[i] - cy;
+			d[i] = ddx * ddx + ddy * ddy;
+		}
+
+		std::fill(histogram.begin(), histogram.end(), 0);
+		for (size_t i = 0; i < pointCount; i++)
+		{
+			int radius = static_cast<int>(std::sqrt(d[i]) + 0.5f);
+			if (radius >= minRadius && radius <= maxRadius)
+				histogram[radius - minRadius]++;
+		}
+
+		float bestRadius = 0;
+		int maxCount = 0;
+		// Radius 0 is not a circle
+		for (int bin = minRadius > 0 ? 0 : 1; bin < static_cast<int>(histogram.size()); bin++)
+		{
+			int count = histogram[bin];
+			float radius = static_cast<float>(minRadius + bin);
+			if (count * bestRadius > maxCount * radius || (maxCount == 0 && count > 0))
+			{
+				bestRadius = radius;
+				maxCount = count;
+			}
+		}
+		if (maxCount > minVotes)
+			mCandidates.push_back({ cv::Vec3f(cx, cy, bestRadius), centerVotes, maxCount });
+	}
+
+	std::stable_sort(mCandidates.begin(), mCandidates.end(), [](const HoughCandidate& a, const HoughCandidate& b) { return a.votes() > b.votes(); });
+}
+
+}
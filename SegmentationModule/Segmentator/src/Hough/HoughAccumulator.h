@@ -0,0 +1,86 @@
+#ifndef __HOUGHACCUMULATOR_H_
+#define __HOUGHACCUMULATOR_H_
+
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace hough
+{
+
+// Circle found by the accumulator
+struct HoughCandidate
+{
+	cv::Vec3f circle;
+	// Accumulator votes of the center
+	int centerVotes;
+	// Edge points at the estimated radius
+	int radiusVotes;
+
+	// Like cv::HoughCircles, a circle is returned when both votes are above param2
+	inline int votes() const { return std::min(centerVotes, radiusVotes); }
+};
+
+/**
+ * Circular Hough transform (gradient method) that votes once and keeps every candidate,
+ * so that each param2 of the search becomes a filter over the same result.
+ *
+ * Approximately equivalent to cv::HoughCircles (HOUGH_GRADIENT, dp = 1, minDist = 1): same edges,
+ * gradient voting and center local maxima, but the radius is estimated differently. Here each center
+ * takes the 1 pixel ring (distances rounded to integers) with most edge points for its length, while
+ * OpenCV slides a 1 pixel window over 0.1 pixel distance bins. So radii are integers, and the radius
+ * votes, hence which circles pass a threshold and their order, can differ from cv::HoughCircles.
+ */
+class HoughAccumulator
+{
+public:
+	/**
+	 * @param img 8 bit grayscale image
+	 * @param cannyThreshold Higher Canny threshold (cv::HoughCircles param1)
+	 * @param minVotes Candidates with minVotes votes or less are dropped
+	 * @param minRadius Minimum circle radius
+	 * @param maxRadius Maximum circle radius, if <= 0 the image size is used
+	 */
+	HoughAccumulator(const cv::Mat& img, double cannyThreshold, int minVotes, int minRadius = 0, int maxRadius = 0);
+	/**
+	 * Constrained search: only centers within centerRange of center are accumulated,
+	 * and only edge points that may lie on such circles vote.
+	 * Candidates are the ones of the unconstrained search centered in that disc,
+	 * so a narrower range is a filter over them
+	 *
+	 * @param center Center of the region of the circles center
+	 * @param centerRange Radius of the region of the circles center
+	 */
+	HoughAccumulator(const cv::Mat& img, double cannyThreshold, int minVotes, int minRadius, int maxRadius, const cv::Point& center, int centerRange);
+	/**
+	 * Circles with more than minVotes votes, what cv::HoughCircles would find with param2 = minVotes
+	 * up to the radius estimation (see the class comment)
+	 *
+	 * @param minVotes Votes threshold, not lower than the one given to the constructor
+	 * @return circles sorted by votes
+	 */
+	std::vector<cv::Vec3f> circles(int minVotes) const;
+	/**
+	 * @return every candidate sorted by votes, highest first
+	 */
+	inline const std::vector<HoughCandidate>& candidates() const { return mCandidates; }
+private:
+	/**
+	 * Vote and estimate the candidates radius
+	 *
+	 * @param img 8 bit grayscale image
+	 * @param center, centerRange Region of the centers, centerRange < 0 for the whole image
+	 */
+	void accumulate(const cv::Mat& img, double cannyThreshold, int minVotes, int minRadius, int maxRadius, const cv::Point& center, int centerRange);
+	/**
+	 * @param edges Edge map
+	 * @param dx, dy CV_16S image gradient
+	 */
+	void accumulate(const cv::Mat& edges, const cv::Mat& dx, const cv::Mat& dy, int minVotes, int minRadius, int maxRadius, const cv::Point& center, int centerRange);
+private:
+	std::vector<HoughCandidate> mCandidates;
+};
+
+}
+
+#endif // !__HOUGHACCUMULATOR_H_
@@ -1,28 +1,26 @@
 #include "Hough/HoughSegmentator.h"
+#include "Execution.h"
 #include "ImagePreproc.h"
 #include "Normalization.h"
 
 #include <opencv2/highgui.hpp>
 #include <algorithm>
-#include <execution>
-#include <mutex>
 namespace hough {
+
+// Lowest param2 of the limbus sweep
+constexpr int LIMBUS_MIN_PARAM2 = 40;
 	
-HoughSegmentator::HoughSegmentator(int finalSize) : mFinalSize(finalSize)
+HoughSegmentator::HoughSegmentator(int finalSize, std::shared_ptr<const EyeDetector> eyeDetector) : Segmentator(std::move(eyeDetector)), mFinalSize(finalSize)
 {
 }
 
-SegmentationData HoughSegmentator::Segment(const cv::Mat& src) const
+SegmentationData HoughSegmentator::Segment(const ImageSource& src, int outputs) const
 {
 	SegmentationData record;
 	cv::Mat img; 
-	src.copyTo(img);
-	// If image is not grayscale convert it 
-	if (img.channels() > 1)
-		cv::cvtColor(img, img, cv::COLOR_BGR2GRAY);
 
 	// Preprocess image
-	auto preprocessInfo = preprocessImage(img, img, mFinalSize);
+	auto preprocessInfo = preprocessImage(src, img, mFinalSize, *mEyeDetector);
 
 	// Crop failed check
 	if (!preprocessInfo.crop.success)
@@ -30,9 +28,14 @@ SegmentationData HoughSegmentator::Segment(const cv::Mat& src) const
 		LOG("Crop failed");
 		return {};
 	}
+	// If image is not grayscale convert it 
+	if (img.channels() > 1)
+		cv::cvtColor(img, img, cv::COLOR_BGR2GRAY);
 	
-	// Find iris circles
-	record.iris = IrisCircles(img);
+	// Find iris circles, the random kernel sizes come from a generator seeded for every call,
+	// so that results are reproducible and the segmentator can be shared between threads
+	cv::RNG rng;
+	record.iris = IrisCircles(img, rng);
 
 	// If iris is not valid (i.e. process failed)
 	if (!record.iris.isValid())
@@ -46,32 +49,41 @@ SegmentationData HoughSegmentator::Segment(const cv::Mat& src) const
 	iris.limbus = TransformCircle(iris.limbus, preprocessInfo.scale.to, preprocessInfo.scale.from);
 	iris.pupil = TransformCircle(iris.pupil, preprocessInfo.scale.to, preprocessInfo.scale.from);
 	
-	img = src(preprocessInfo.crop.roi);
+	img = src.region(preprocessInfo.crop.roi);
 
 	// Normalize iris
-	record.irisNormalized = normalizeIris(img, iris);
+	record.irisNormalized = normalizeIris(img, iris, mNormalizationParams, outputs);
 	
 	return record;
 }
 
-Iris HoughSegmentator::IrisCircles(const cv::Mat& img) const
+Iris HoughSegmentator::IrisCircles(const cv::Mat& img, cv::RNG& rng) const
 {
 	Iris iris;
 	LOG("Looking for a pupil");
-	iris.pupil = PupilCircle(img);
+	iris.pupil = PupilCircle(img, rng);
 	if (!iris.pupil.isValid()) return {};
 	LOG("Pupil found");
 	// finding limbus
 	int radiusRange = std::ceil(iris.pupil.radius * 1.5);
+	// Center ranges of the search, from the narrowest
+	std::vector<std::pair<float, int>> centerRanges;
 	float multiplier = 0.25f;
 	do
 	{
-		LOG("looking for limbus");
 		multiplier += 0.05f;
-		int centerRange = std::ceil(iris.pupil.radius * multiplier);
+		centerRanges.push_back({ multiplier, static_cast<int>(std::ceil(iris.pupil.radius * multiplier)) });
+	} while (multiplier <= 0.7);
+
+	// Vote once for the widest range, narrower ones filter the same candidates
+	LOG("looking for limbus");
+	auto accumulators = LimbusAccumulators(img, iris.pupil, centerRanges.back().second, rng);
+	for (const auto& [multiplier, centerRange] : centerRanges)
+	{
 		LOG("Searching limbus with multiplier " << multiplier);
-		iris.limbus = LimbusCircle(img, iris.pupil, centerRange, radiusRange);
-	} while (!iris.limbus.isValid() && multiplier <= 0.7);
+		iris.limbus = LimbusCircle(accumulators, iris.pupil, centerRange, radiusRange);
+		if (iris.limbus.isValid()) break;
+	}
 	if (iris.limbus.isValid())
 	{
 		LOG("Limbus found: " << iris.limbus);
@@ -79,48 +91,62 @@ Iris HoughSegmentator::IrisCircles(const cv::Mat& img) const
 	return iris;
 }
 
-Circle HoughSegmentator::PupilCircle(const cv::Mat& img) const
+Circle HoughSegmentator::PupilCircle(const cv::Mat& img, cv::RNG& rng) const
 {
-	auto getEdges = [&](const cv::Mat& img) {
+	auto getEdges = [&](const cv::Mat& img, int kSize) {
 		cv::Mat edges;
 		cv::Canny(img, edges, 20, 100);
 		cv::dilate(edges, edges, cv::Mat::ones(3, 3, CV_8UC1), cv::Point(-1, -1), 2);
-		int kSize = 2 * mRng.uniform(5, 11) + 1;
 		cv::GaussianBlur(edges, edges, cv::Size(kSize, kSize), 0);
 		return edges;
 	};
 
 	int param1 = 200;
+	// Lowest param2 of the sweep
+	int minParam2 = 35;
+
+	const std::vector<int> medians = { 3, 5, 7 };
+	const std::vector<int> thresholds = { 20, 25, 30, 35, 40, 45, 50, 55, 60 };
+	size_t cells = medians.size() * thresholds.size();
+
+	// Median blur
+	std::vector<cv::Mat> medianImgs(medians.size());
+	parallelFor(medians.size(), [&](size_t i) { cv::medianBlur(img, medianImgs[i], 2 * medians[i] + 1); });
+
+	// Kernel sizes are drawn in cell order, so that results don't depend on scheduling
+	std::vector<int> kSizes(cells);
+	for (auto& kSize : kSizes) kSize = 2 * rng.uniform(5, 11) + 1;
+
+	// Edge images don't depend on param2: vote once for every (median, threshold) cell, cells run in parallel
+	auto accumulators = parallelCollect<HoughAccumulator>(cells, [&](size_t cell, std::vector<HoughAccumulator>& out)
+	{
+		const cv::Mat& medianImg = medianImgs[cell / thresholds.size()];
+		int threshold = thresholds[cell % thresholds.size()];
+
+		// threshold
+		cv::Mat thresholdImg;
+		cv::threshold(medianImg, thresholdImg, threshold, 255, cv::THRESH_BINARY_INV);
+		
+		// Find contours
+		std::vector<std::vector<cv::Point>> contours;
+		cv::findContours(thresholdImg, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE);
+
+		cv::drawContours(thresholdImg, contours, -1, cv::Scalar(255), -1);
+		// Canny
+		out.emplace_back(getEdges(thresholdImg, kSizes[cell]), param1, minParam2);
+	});
+
 	int param2 = 120;
 	std::vector<cv::Vec3f> pupilCircles = {};
-	while (param2 > 35 && pupilCircles.size() < 100)
+	while (param2 > minParam2 && pupilCircles.size() < 100)
 	{
-		for (int median : {3, 5, 7})
+		for (const auto& accumulator : accumulators)
 		{
-			for (int threshold : {20, 25, 30, 35, 40, 45, 50, 55, 60})
+			// Circles with more than param2 votes
+			auto circles = accumulator.circles(param2);
+			if (!circles.empty())
 			{
-				// Median blur
-				cv::Mat medianImg;
-				cv::medianBlur(img, medianImg, 2 * median + 1);
-				// threshold
-				cv::Mat thresholdImg;
-				cv::threshold(medianImg, thresholdImg, threshold, 255, cv::THRESH_BINARY_INV);
-				
-				// Find contours
-				std::vector<std::vector<cv::Point>> contours;
-				cv::findContours(thresholdImg, contours, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_NONE);
-
-				cv::drawContours(thresholdImg, contours, -1, cv::Scalar(255), -1);
-				// Canny
-				auto edges = getEdges(thresholdImg);
-
-				// HoughCircles
-				std::vector<cv::Vec3f> circles = {};
-				cv::HoughCircles(edges, circles, cv::HOUGH_GRADIENT, 1, 1, param1, param2);
-				if (!circles.empty())
-				{
-					pupilCircles.insert(pupilCircles.end(), circles.begin(), circles.end());
-				}
+				pupilCircles.insert(pupilCircles.end(), circles.begin(), circles.end());
 			}
 		}
 		--param2;
@@ -152,39 +178,20 @@ std::vector<cv::Vec3f> filterCircles(std::vector<cv::Vec3f>& circles)
 {
 	cv::Vec3d mean, std;
 	cv::meanStdDev(circles, mean, std);
-	std::vector<cv::Vec3f> filteredPos;
 	std::vector<cv::Vec3f> filtered;
 	float ratio = 1.5;
 	
-	#ifdef USE_PARALLEL_ALGORITHM
-
-	std::mutex m;
-	std::for_each(std::execution::par, circles.begin(), circles.end(), [&](auto& circle)
+	auto meanCenter = cv::Vec2i(mean[0], mean[1]);
+	auto stdCenter = cv::Vec2i(std[0], std[1]);
+	auto tmp1 = meanCenter - ratio * stdCenter;
+	auto tmp2 = meanCenter + ratio * stdCenter;
+	auto filteredPos = parallelCollect<cv::Vec3f>(circles.size(), [&](size_t i, std::vector<cv::Vec3f>& out)
 	{
-		auto meanCenter = cv::Vec2i(mean[0], mean[1]);
-		auto stdCenter = cv::Vec2i(std[0], std[1]);
-		auto tmp1 = meanCenter - ratio * stdCenter;
-		auto tmp2 = meanCenter + ratio * stdCenter;
+		const auto& circle = circles[i];
 		if (!(circle[0] < tmp1[0] || circle[0] > tmp2[0] || circle[1] < tmp1[1] || circle[1] > tmp2[1]))
-		{
-			std::lock_guard<std::mutex> guard(m);
-			filteredPos.push_back(circle);
-		}
+			out.push_back(circle);
 	});
 
-	#else
-	for(const auto& circle : circles)
-	{
-		auto meanCenter = cv::Vec2i(mean[0], mean[1]);
-		auto stdCenter = cv::Vec2i(std[0], std[1]);
-		auto tmp1 = meanCenter - ratio * stdCenter;
-		auto tmp2 = meanCenter + ratio * stdCenter;
-		if (!(circle[0] < tmp1[0] || circle[0] > tmp2[0] || circle[1] < tmp1[1] || circle[1] > tmp2[1]))
-		{
-			filteredPos.push_back(circle);
-		}
-	}
-	#endif
 	if (filteredPos.size() < 3) filtered = filteredPos;
 	else
 	{
@@ -193,86 +200,80 @@ std::vector<cv::Vec3f> filterCircles(std::vector<cv::Vec3f>& circles)
 		cv::meanStdDev(filteredPos, filteredMean, filteredStd);
 		float maxRadius = alphaRadius + filteredStd[2];
 		float minRadius = alphaRadius - filteredStd[2];
-		//std::mutex m;
-		
-		#ifdef USE_PARALLEL_ALGORITHM
-		auto it = std::remove_if(circles.begin(), circles.end(), [&](auto& circle) {return !(circle[2] >= minRadius && circle[2] <= maxRadius); });
-		filtered.resize(static_cast<int>(std::distance(circles.begin(), it)));
-		std::atomic_int idx = 0;
-		std::for_each(std::execution::par, circles.begin(), it, [&](auto& circle)
+		filtered = parallelCollect<cv::Vec3f>(circles.size(), [&](size_t i, std::vector<cv::Vec3f>& out)
 		{
-			filtered[idx.fetch_add(1)] = circle;
+			const auto& circle = circles[i];
+			if (circle[2] >= minRadius && circle[2] <= maxRadius)
+				out.push_back(circle);
 		});
-		#else
-		for(auto& circle : circles)
-		{
-			if(circle[2] >= minRadius && circle[2] <= maxRadius)
-				filtered.push_back(circle);
-		}
-		#endif
 	}
 	return filtered;
 }
 
-Circle HoughSegmentator::LimbusCircle(const cv::Mat& img, const Circle& pupil, int centerRange, int radiusRange) const
+std::vector<HoughAccumulator> HoughSegmentator::LimbusAccumulators(const cv::Mat& img, const Circle& pupil, int maxCenterRange, cv::RNG& rng) const
 {
-	auto getEdges = [&](const cv::Mat& img, int threshold)
+	auto getEdges = [&](cv::Mat edges, int kSize)
 	{
-		cv::Mat edges;
-		cv::Canny(img, edges, 0, threshold, 5);
 		cv::dilate(edges, edges, cv::Mat::ones(cv::Size(3, 3), CV_8UC1));
-		int kSize = 2 * mRng.uniform(5, 11) + 1;
 		cv::GaussianBlur(edges, edges, cv::Size(kSize, kSize), 0);
 		return edges;
 	};
 
+	int param1 = 200;
+
+	const std::vector<int> medians = { 8, 10, 12, 14, 16, 18, 20 };
+	const std::vector<int> thresholds = { 430, 480, 530 };
+	size_t cells = medians.size() * thresholds.size();
+
+	std::vector<cv::Vec2d> cannyThresholds;
+	for (int threshold : thresholds) cannyThresholds.push_back({ 0, static_cast<double>(threshold) });
+
+	// Median blur, then Canny with every threshold from the same derivatives
+	std::vector<std::vector<cv::Mat>> edgeMaps(medians.size());
+	parallelFor(medians.size(), [&](size_t i)
+	{
+		cv::Mat medianImg;
+		cv::medianBlur(img, medianImg, 2 * medians[i] + 1);
+		edgeMaps[i] = cannyBank(medianImg, cannyThresholds, 5);
+	});
+
+	// Kernel sizes are drawn in cell order, so that results don't depend on scheduling
+	std::vector<int> kSizes(cells);
+	for (auto& kSize : kSizes) kSize = 2 * rng.uniform(5, 11) + 1;
+
+	// Vote once for every (median, threshold) cell, only for centers around the pupil, cells run in parallel.
+	// Every radius votes, as in the full image search: a minimum radius would also change the votes and radii of the others
+	auto accumulators = parallelCollect<HoughAccumulator>(cells, [&](size_t cell, std::vector<HoughAccumulator>& out)
+	{
+		// Every edge map belongs to one cell, so it's dilated and blurred in place
+		cv::Mat cannyImg = edgeMaps[cell / thresholds.size()][cell % thresholds.size()];
+		out.emplace_back(getEdges(cannyImg, kSizes[cell]), param1, LIMBUS_MIN_PARAM2, 0, 0, cv::Point(pupil.center), maxCenterRange);
+	});
+	return accumulators;
+}
+
+Circle HoughSegmentator::LimbusCircle(const std::vector<HoughAccumulator>& accumulators, const Circle& pupil, int centerRange, int radiusRange) const
+{
 	// check if p is inside c1
 	auto inside = [](const Circle& c1, const cv::Vec2i p) { return cv::norm(p - c1.center) <= c1.radius; };
 
-	int param1 = 200;
 	int param2 = 120;
 	std::vector<cv::Vec3f> limbusCircles = {};
-	while (param2 > 40 && limbusCircles.size() < 50)
+	while (param2 > LIMBUS_MIN_PARAM2 && limbusCircles.size() < 50)
 	{
-		for (int median : {8, 10, 12, 14, 16, 18, 20})
+		for (const auto& accumulator : accumulators)
 		{
-			for (int threshold : {430, 480, 530})
+			// Circles with more than param2 votes
+			auto circles = accumulator.circles(param2);
+
+			// Filter and push circles
+			auto accepted = parallelCollect<cv::Vec3f>(circles.size(), [&](size_t i, std::vector<cv::Vec3f>& out)
 			{
-				// Median blur
-				cv::Mat medianImg;
-				cv::medianBlur(img, medianImg, 2 * median + 1);
-
-				// Canny
-				auto edges = getEdges(medianImg, threshold);
-
-				// HoughCircles
-				std::vector<cv::Vec3f> circles = {};
-				cv::HoughCircles(edges, circles, cv::HOUGH_GRADIENT, 1, 1, param1, param2);
-
-				if (!circles.empty())
-				{
-					#ifdef USE_PARALLEL_ALGORITHM
-					std::mutex m;
-					// Filter and push circles
-					std::for_each(std::execution::par, circles.begin(), circles.end(), [&](auto& circle)
-					{
-						if (circle[2] > radiusRange && inside({ centerRange, pupil.center }, cv::Vec2i(circle[0], circle[1])))
-						{
-							std::lock_guard<std::mutex> guard(m);
-							limbusCircles.push_back(circle);
-						}
-					});
-					#else
-					for(auto& circle : circles)
-					{
-						if (circle[2] > radiusRange && inside({ centerRange, pupil.center }, cv::Vec2i(circle[0], circle[1])))
-						{
-							limbusCircles.push_back(circle);
-						}
-					}
-					#endif
-				}
-			}
+				const auto& circle = circles[i];
+				if (circle[2] > radiusRange && inside({ centerRange, pupil.center }, cv::Vec2i(circle[0], circle[1])))
+					out.push_back(circle);
+			});
+			limbusCircles.insert(limbusCircles.end(), accepted.begin(), accepted.end());
 		}
 		--param2;
 	}
@@ -1,6 +1,7 @@
 #ifndef __HOUGHSEGMENTATOR_H_
 #define __HOUGHSEGMENTATOR_H_
 #include "Segmentation.h"
+#include "Hough/HoughAccumulator.h"
 
 
 namespace hough
@@ -10,40 +11,62 @@ class HoughSegmentator : public Segmentator
 {
 public:
 
-	HoughSegmentator(int finalSize = 500);
+	/**
+	 * @param finalSize Size of the scaled image used for circles search
+	 * @param eyeDetector Eye detector used for cropping, if null a new one is loaded
+	 */
+	HoughSegmentator(int finalSize = 500, std::shared_ptr<const EyeDetector> eyeDetector = nullptr);
+	using Segmentator::Segment;
 	/**
 	 * Segment iris image
 	 *
-	 * @param img Iris image
+	 * @param src Iris image, the circles are searched at its reduced resolution
+	 * @param outputs NormalizationOutput bitmask of the normalized images to produce
 	 * @return SegmentationData struct containing all segmentation informations: limbus and pupil circle, normalization data, etc..
 	 */
-	SegmentationData Segment(const cv::Mat& img) const override;
+	SegmentationData Segment(const ImageSource& src, int outputs = NORMALIZED_ALL) const override;
+	inline int searchSize() const override { return mFinalSize; }
 // Private methods
 private:
 	/**
 	 * Find two circles: limbus and pupil
 	 *
 	 * @param img Iris image
+	 * @param rng Random generator of this segmentation
 	 * @return Iris struct object
 	 */
-	Iris IrisCircles(const cv::Mat& img) const;
+	Iris IrisCircles(const cv::Mat& img, cv::RNG& rng) const;
 	/**
 	 * Find pupil circle
 	 *
 	 * @param img Iris image
+	 * @param rng Random generator of this segmentation
 	 * @return pupil circle
 	 */
-	Circle PupilCircle(const cv::Mat& img) const;
+	Circle PupilCircle(const cv::Mat& img, cv::RNG& rng) const;
 	/**
-	 * Find limbus circle
+	 * Vote for limbus circles around the pupil. Radii are not restricted here, the minimum limbus
+	 * radius is a filter of LimbusCircle, so candidates are the ones of an unconstrained search
 	 *
 	 * @param img Iris image
+	 * @param pupil Pupil circle
+	 * @param maxCenterRange Maximum distance between limbus and pupil centers
+	 * @param rng Random generator of this segmentation
+	 * @return one accumulator for each edge image
+	 */
+	std::vector<HoughAccumulator> LimbusAccumulators(const cv::Mat& img, const Circle& pupil, int maxCenterRange, cv::RNG& rng) const;
+	/**
+	 * Find limbus circle
+	 *
+	 * @param accumulators Limbus votes, from LimbusAccumulators
+	 * @param pupil Pupil circle
+	 * @param centerRange Maximum distance between limbus and pupil centers, not above the accumulators one
+	 * @param radiusRange Minimum limbus radius
 	 * @return limbus circle
 	 */
-	Circle LimbusCircle(const cv::Mat& img, const Circle& pupil, int centerRange, int radiusRange) const;
+	Circle LimbusCircle(const std::vector<HoughAccumulator>& accumulators, const Circle& pupil, int centerRange, int radiusRange) const;
 private:
 	int mFinalSize;
-	mutable cv::RNG mRng;
 
 };
 
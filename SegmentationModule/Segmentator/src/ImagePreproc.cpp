@@ -1,23 +1,25 @@
 #include "ImagePreproc.h"
 #include "Util.h"
+#include "Execution.h"
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
 namespace erb
 {
 
-std::vector<cv::Rect> getEyeRegionsOfInterest(const cv::Mat& src)
+std::vector<cv::Rect> getEyeRegionsOfInterest(const cv::Mat& src, const EyeDetector& detector)
 {
-    auto eyeCascadeClassifier = cv::CascadeClassifier("haarcascade_eye_tree_eyeglasses.xml");
-    auto eyes = std::vector<cv::Rect>();
-    eyeCascadeClassifier.detectMultiScale(src, eyes, 1.1, 3, 0, cv::Size(), src.size());
-    return eyes;
+    return detector.detect(src);
 }
 
-CropEyeInfo automaticCrop(const cv::Mat& src, cv::Mat& out)
+CropEyeInfo automaticCrop(const cv::Mat& src, cv::Mat& out, const EyeDetector& detector, int minWidth)
 {
     CropEyeInfo info;
     info.success = true;
-    auto eyes = getEyeRegionsOfInterest(src);
+    auto eyes = getEyeRegionsOfInterest(src, detector);
     if (eyes.size() == 0) 
     {
         info.success = false;
@@ -26,7 +28,7 @@ CropEyeInfo automaticCrop(const cv::Mat& src, cv::Mat& out)
 
     // I take the eye with the largest area
     info.roi = *std::max_element(eyes.begin(), eyes.end(), [](const cv::Rect& l, const cv::Rect& r) { return l.area() < r.area(); });
-    if (info.roi.width < 120) 
+    if (info.roi.width < minWidth) 
     {
         info.success = false;
         return info;
@@ -111,79 +113,166 @@ void automaticBrightnessContrast(const cv::Mat& src, cv::Mat& out)
     //auto_result = cv2.convertScaleAbs(image, alpha=alpha, beta=beta)
 }
 
-PreprocessInfo preprocessImage(const cv::Mat& src, cv::Mat& out, int scaleSize)
+PreprocessInfo preprocessImage(const cv::Mat& src, cv::Mat& out, int scaleSize, const EyeDetector& detector)
+{
+    return preprocessImage(ImageSource(src), out, scaleSize, detector);
+}
+
+PreprocessInfo preprocessImage(const ImageSource& src, cv::Mat& out, int scaleSize, const EyeDetector& detector)
 {
     cv::Mat eye;
     PreprocessInfo info;
-    info.crop = automaticCrop(src, eye);
+    // The smallest eye accepted is 120 pixels wide at full resolution
+    info.crop = automaticCrop(src.image(), eye, detector, 120 / src.reduction());
     if (!info.crop.success)
     {
         LOG("Cannot find an eye in the image, assuming there's one at the center");
-        info.crop = manualCrop(src, eye);
+        info.crop = manualCrop(src.image(), eye);
     }
+    info.crop.roi = src.toFull(info.crop.roi);
+
+    // The reduced crop is enough for the circles search, unless it would be upscaled
+    if (src.reduction() > 1 && std::max(eye.cols, eye.rows) < scaleSize)
+        eye = src.region(info.crop.roi);
 
     // scale image to low res for speeding up next computations
     cv::Mat eyeScaled;
     info.scale = scaleImage(eye, eyeScaled, scaleSize);
-    LOG("Image scaled from [" << eye.rows << "x" << eye.cols << "] ==> [" << eyeScaled.rows << "x" << eyeScaled.cols << "]");
+    // Circles of the scaled image are mapped back to the full resolution crop
+    info.scale.from = info.crop.roi.size();
+    LOG("Image scaled from [" << info.scale.from.height << "x" << info.scale.from.width << "] ==> [" << eyeScaled.rows << "x" << eyeScaled.cols << "]");
     out = eyeScaled;
     return info;
 }
 
+// Histogram of a column slice of the image
+using ColumnHistogram = std::array<uint16_t, 256>;
+// Histogram of the whole sliding window
+using WindowHistogram = std::array<int, 256>;
+
+// Written as fixed length loops so that they get vectorized
+inline void addHistogram(WindowHistogram& dst, const ColumnHistogram& src)
+{
+    for (int i = 0; i < 256; i++) dst[i] += src[i];
+}
+
+inline void subHistogram(WindowHistogram& dst, const ColumnHistogram& src)
+{
+    for (int i = 0; i < 256; i++) dst[i] -= src[i];
+}
+
+// Most frequent colour in the histogram, ties go to the darkest colour
+inline int histogramMode(const WindowHistogram& hist)
+{
+    // Highest count, then its first colour: the max loop is branchless so that it gets vectorized
+    int top = 0;
+    for (int i = 0; i < 256; i++) top = std::max(top, hist[i]);
+    int mode = 0;
+    while (hist[mode] != top) mode++;
+    return mode;
+}
+
 void posterization(const cv::Mat& src, cv::Mat& out, int k)
 {
-    out = cv::Mat::zeros(src.rows, src.cols, src.type());
-    int x = 0;
+    // out may alias src, so the result is written in a new buffer
+    cv::Mat dst(src.rows, src.cols, src.type());
+
+    // One histogram for every column, covering the rows of the current sliding window
+    auto columns = std::vector<ColumnHistogram>(src.cols, ColumnHistogram{});
+    for (int y = 0; y < std::min(k, src.rows); y++)
+    {
+        const uchar* row = src.ptr<uchar>(y);
+        for (int x = 0; x < src.cols; x++) columns[x][row[x]]++;
+    }
 
     // For each row
     for (int y = 0; y < src.rows; y++)
     {
-        // I initialise a new histogram and a new sliding window of size (k*2+1)^2
-        auto histo = std::unordered_map<uchar, int>();
-        SlidingWindow slidingWindow = SlidingWindow::getSlidingWindow(src, y, x, k);
-
-        // topcolor is the most frequent colour
-        int topColor = -1;
-
-        // calculate histogram in the window
-        for (int ty = slidingWindow.sy; ty < slidingWindow.ey; ty++)
+        // Move column histograms one row down, window rows are [y-k, y+k)
+        if (y > 0)
         {
-            for (int tx = slidingWindow.sx; tx < slidingWindow.ex; tx++)
+            if (y - k - 1 >= 0)
+            {
+                const uchar* row = src.ptr<uchar>(y - k - 1);
+                for (int x = 0; x < src.cols; x++) columns[x][row[x]]--;
+            }
+            if (y + k - 1 < src.rows)
             {
-                int colore = src.at<uchar>(ty, tx);
-                if (topColor == -1) topColor = colore;
-                histo[colore] += 1;
-                if (histo[topColor] < histo[colore]) topColor = colore;
+                const uchar* row = src.ptr<uchar>(y + k - 1);
+                for (int x = 0; x < src.cols; x++) columns[x][row[x]]++;
             }
         }
+        int sy = std::max(y - k, 0), ey = std::min(y + k, src.rows);
+
+        // Window histogram for the first column, window columns are [x-k, x+k)
+        WindowHistogram histo{};
+        for (int x = 0; x < std::min(k, src.cols); x++) addHistogram(histo, columns[x]);
 
-        // Sets the colour of the pixel in the first column of the image to the most frequent one
-        out.at<uchar>(y, x) = topColor;
+        // topcolor is the most frequent colour
+        int topColor = histogramMode(histo);
+        uchar* outRow = dst.ptr<uchar>(y);
+        outRow[0] = static_cast<uchar>(topColor);
 
         // For other columns
         for (int x = 1; x < src.cols; x++)
         {
-            auto newSlidingWindow = SlidingWindow::getSlidingWindow(src, y, x, k);
-            // Scroll for each line of the sliding window
-            for (int ty = slidingWindow.sy; ty < slidingWindow.ey; ty++)
-            {
-                // Deletes the occurrences of the pixels in the first column of the sliding window from the histogram.
-                histo[src.at<uchar>(ty, slidingWindow.sx)] -= 1;
-
-                // scroll the window to the right
-//                slidingWindow = SlidingWindow::getSlidingWindow(src, y, x, k);
+            int topCount = histo[topColor];
+            // Remove the column leaving the window and add the one entering it
+            if (x - k - 1 >= 0) subHistogram(histo, columns[x - k - 1]);
+            int addedColumn = x + k - 1;
+            if (addedColumn < src.cols) addHistogram(histo, columns[addedColumn]);
 
-                // Get the colour in the last column and update the histogram
-                auto colorTmp = src.at<uchar>(ty, newSlidingWindow.ex - 1);
-                histo[colorTmp] += 1;
-                // Update topColor
-                if (histo[topColor] < histo[colorTmp]) topColor = colorTmp;
+            if (histo[topColor] < topCount)
+            {
+                // topColor lost occurrences, another colour may be the most frequent now
+                topColor = histogramMode(histo);
             }
-            slidingWindow = newSlidingWindow;
-            // Assign top color
-            out.at<uchar>(y, x) = topColor;
+            else if (addedColumn < src.cols)
+            {
+                // Only colours of the added column may have overtaken topColor
+                for (int ty = sy; ty < ey; ty++)
+                {
+                    int color = src.at<uchar>(ty, addedColumn);
+                    if (histo[color] > histo[topColor] || (histo[color] == histo[topColor] && color < topColor))
+                        topColor = color;
+                }
+            }
+            outRow[x] = static_cast<uchar>(topColor);
         }
     }
+    out = dst;
+}
+
+std::vector<cv::Mat> posterizationBank(const cv::Mat& src, int kMin, int kMax)
+{
+    auto bank = std::vector<cv::Mat>(std::max(0, kMax - kMin + 1));
+    // Each level slides its own window (O(1) histogram updates per pixel), levels run in parallel
+    parallelFor(bank.size(), [&](size_t i) { posterization(src, bank[i], kMin + static_cast<int>(i)); });
+    return bank;
 }
 
-}
\ No newline at end of file
+PosterizationIterator::PosterizationIterator(const cv::Mat& src, int kMin, int kMax) : mSrc(src), mK(kMin), mKMax(kMax)
+{
+}
+
+bool PosterizationIterator::next(cv::Mat& out)
+{
+    if (mK > mKMax) return false;
+    posterization(mSrc, out, mK++);
+    return true;
+}
+
+std::vector<cv::Mat> cannyBank(const cv::Mat& src, const std::vector<cv::Vec2d>& thresholds, int apertureSize)
+{
+    // Same derivatives cv::Canny computes from an image
+    cv::Mat dx, dy;
+    cv::Sobel(src, dx, CV_16S, 1, 0, apertureSize, 1, 0, cv::BORDER_REPLICATE);
+    cv::Sobel(src, dy, CV_16S, 0, 1, apertureSize, 1, 0, cv::BORDER_REPLICATE);
+
+    // Only the hysteresis depends on the thresholds
+    std::vector<cv::Mat> edges(thresholds.size());
+    parallelFor(thresholds.size(), [&](size_t i) { cv::Canny(dx, dy, edges[i], thresholds[i][0], thresholds[i][1]); });
+    return edges;
+}
+
+}
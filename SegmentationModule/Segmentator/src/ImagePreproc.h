@@ -1,6 +1,9 @@
 #ifndef __IMAGEPREPROC_H_
 #define __IMAGEPREPROC_H_
 
+#include "EyeDetector.h"
+#include "ImageSource.h"
+
 #include <opencv2/imgproc.hpp>
 namespace erb
 {
@@ -26,36 +29,22 @@ struct PreprocessInfo
     ScaleEyeInfo scale;
 };
 
-// Window used for the posterization filter
-struct SlidingWindow
-{
-    int sx, ex, sy, ey;
-    static inline SlidingWindow getSlidingWindow(const cv::Mat& img, int y, int x, int k)
-    {
-        auto sw = SlidingWindow{};
-        // colonna iniziale e finale
-        sw.sx = x - k >= 0 ? x - k : 0;
-        sw.ex = x + k <= img.cols ? x + k : img.cols;
-        // riga iniziale e finale
-        sw.sy = y - k >= 0 ? y - k : 0;
-        sw.ey = y + k <= img.rows ? y + k : img.rows;
-        return sw;
-    }
-};
-
 /*
 * Find all possible ROIs of an eye in an image
 * @param src: input image
+* @param detector: eye detector
 * @return list of candidates ROIs
 */
-std::vector<cv::Rect> getEyeRegionsOfInterest(const cv::Mat& src);
+std::vector<cv::Rect> getEyeRegionsOfInterest(const cv::Mat& src, const EyeDetector& detector);
 /*
 * Crop an iris image on the eye using an Haar Cascade classifier
 * @param src: input iris image
 * @param out: output cropped image
+* @param detector: eye detector
+* @param minWidth: smallest eye width accepted, in src pixels
 * @return crop process info
 */
-CropEyeInfo automaticCrop(const cv::Mat& src, cv::Mat& out);
+CropEyeInfo automaticCrop(const cv::Mat& src, cv::Mat& out, const EyeDetector& detector, int minWidth = 120);
 /*
 * Crop an iris image on the eye on the center of the image
 * @param src: input iris image
@@ -89,17 +78,67 @@ void automaticBrightnessContrast(const cv::Mat& src, cv::Mat& out);
 * Preprocess iris image, preparing it for segmentation
 * @param src: input iris image
 * @param out: output preprocessed image
+* @param scaleSize: size of the scaled image
+* @param detector: eye detector used for cropping
 * @return preprocessing info
 */
-PreprocessInfo preprocessImage(const cv::Mat& src, cv::Mat& out, int scaleSize);
-
+PreprocessInfo preprocessImage(const cv::Mat& src, cv::Mat& out, int scaleSize, const EyeDetector& detector);
 /*
-* Apply a posterization filter
+* Preprocess iris image, the eye is searched on the reduced image of src.
+* Full resolution pixels are decoded only if the reduced crop is smaller than scaleSize
 * @param src: input iris image
+* @param out: output preprocessed image
+* @param scaleSize: size of the scaled image
+* @param detector: eye detector used for cropping
+* @return preprocessing info, crop and scale are relative to the full resolution image
+*/
+PreprocessInfo preprocessImage(const ImageSource& src, cv::Mat& out, int scaleSize, const EyeDetector& detector);
+
+/*
+* Apply a posterization filter: every pixel takes the most frequent colour in its window.
+* Runs in constant time per pixel with respect to k (sliding column histograms).
+* @param src: input iris image (CV_8UC1)
 * @param out: output image
 * @param k: window size parameter, wSize = k*2+1
 */
 void posterization(const cv::Mat& src, cv::Mat& out, int k);
 
+/*
+* Apply the posterization filter for every k in [kMin, kMax], levels are filtered in parallel on the execution backend
+* @param src: input iris image (CV_8UC1)
+* @param kMin: first window size parameter
+* @param kMax: last window size parameter
+* @return posterized images, element i is filtered with k = kMin + i
+*/
+std::vector<cv::Mat> posterizationBank(const cv::Mat& src, int kMin, int kMax);
+
+// Lazy alternative to posterizationBank: levels are computed one at a time, so a caller can stop early
+class PosterizationIterator
+{
+public:
+    PosterizationIterator(const cv::Mat& src, int kMin, int kMax);
+    /*
+    * Compute the next posterization level
+    * @param out: output image
+    * @return false when all levels have been produced
+    */
+    bool next(cv::Mat& out);
+    // Window size parameter of the next level
+    inline int k() const { return mK; }
+private:
+    cv::Mat mSrc;
+    int mK, mKMax;
+};
+
+/*
+* Apply Canny edge detection with many thresholds to the same image.
+* Image derivatives are computed once and shared by every threshold.
+* @param src: input image (CV_8UC1)
+* @param thresholds: (low, high) hysteresis thresholds of every edge map
+* @param apertureSize: Sobel aperture size
+* @return edge maps, element i is found with thresholds[i]
+*/
+std::vector<cv::Mat> cannyBank(const cv::Mat& src, const std::vector<cv::Vec2d>& thresholds, int apertureSize = 3);
+
 }
 #endif // !__IMAGEPREPROC_H_
@@ -0,0 +1,242 @@
+#include "ImageSource.h"
+#include "Util.h"
+
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+
+#ifdef ERB_HAVE_LIBJPEG
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
+
+namespace erb
+{
+
+#if defined(ERB_HAVE_LIBJPEG) && defined(LIBJPEG_TURBO_VERSION)
+
+// libjpeg errors jump back to the decoding step instead of exiting
+struct JpegError
+{
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+void jpegErrorExit(j_common_ptr cinfo)
+{
+    std::longjmp(reinterpret_cast<JpegError*>(cinfo->err)->jump, 1);
+}
+
+void jpegSilence(j_common_ptr) {}
+
+// Decompressor and its error handler, only plain C structures so that a longjmp skips no destructor
+struct JpegDecoder
+{
+    jpeg_decompress_struct cinfo;
+    JpegError error;
+};
+
+/*
+* Orientation tag of the EXIF segment saved by libjpeg
+* @param markers: saved APP1 markers
+* @return EXIF orientation, 1 (no transform) if there's none
+*/
+int exifOrientation(jpeg_saved_marker_ptr markers)
+{
+    for (auto marker = markers; marker; marker = marker->next)
+    {
+        const uchar* data = marker->data;
+        size_t size = marker->data_length;
+        if (marker->marker != JPEG_APP0 + 1 || size < 14 || std::string(data, data + 6) != std::string("Exif\0\0", 6)) continue;
+        // TIFF header: byte order, 42, offset of the first directory
+        const uchar* tiff = data + 6;
+        size -= 6;
+        bool little = tiff[0] == 'I';
+        auto read16 = [&](size_t at) { return little ? tiff[at] | tiff[at + 1] << 8 : tiff[at] << 8 | tiff[at + 1]; };
+        auto read32 = [&](size_t at) { return little ? uint32_t(read16(at)) | uint32_t(read16(at + 2)) << 16 : uint32_t(read16(at)) << 16 | uint32_t(read16(at + 2)); };
+        size_t directory = read32(4);
+        if (directory + 2 > size) return 1;
+        int entries = read16(directory);
+        for (int i = 0; i < entries && directory + 2 + (i + 1) * 12 <= size; i++)
+        {
+            size_t entry = directory + 2 + i * 12;
+            if (read16(entry) == 0x0112) return read16(entry + 8);
+        }
+    }
+    return 1;
+}
+
+/*
+* Read the header and start decompressing the rows of a region.
+* Runs between setjmp and libjpeg calls, so it must not hold objects with destructors
+* @param decoder: decompressor, destroyed on failure
+* @param data: JPEG file content
+* @param searchSize: if roi is empty, the largest reduction keeping 2 * searchSize pixels on its short side is used
+* @param roi: region to decode, clipped to the reduced image (the whole image if empty)
+* @param xOffset, width: decoded columns, roi widened to the iMCU boundaries
+* @param reduction: output reduction
+* @param size: full resolution size
+* @return false on errors and EXIF rotations
+*/
+bool startJpeg(JpegDecoder& decoder, const std::vector<uchar>& data, int searchSize, cv::Rect& roi, JDIMENSION& xOffset, JDIMENSION& width, int& reduction, cv::Size& size)
+{
+    auto& cinfo = decoder.cinfo;
+    cinfo.err = jpeg_std_error(&decoder.error.manager);
+    decoder.error.manager.error_exit = jpegErrorExit;
+    decoder.error.manager.output_message = jpegSilence;
+    if (setjmp(decoder.error.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), data.size());
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&cinfo, TRUE);
+
+    // cv::imread applies the EXIF orientation, leave rotated images to it
+    if (exifOrientation(cinfo.marker_list) != 1)
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    size = cv::Size(cinfo.image_width, cinfo.image_height);
+    reduction = 1;
+    if (roi.empty())
+        while (reduction < 8 && std::min(size.width, size.height) / (reduction * 2) >= 2 * searchSize) reduction *= 2;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = reduction;
+    cinfo.out_color_space = JCS_EXT_BGR;
+    jpeg_start_decompress(&cinfo);
+
+    // Rows above the region are skipped, columns are cropped to the closest iMCU boundaries
+    cv::Rect image(0, 0, cinfo.output_width, cinfo.output_height);
+    roi = roi.empty() ? image : roi & image;
+    if (roi.empty())
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    // One more iMCU on both sides, so that the border columns are upsampled with their neighbours as in a full decode
+    int iMCUWidth = cinfo.max_h_samp_factor * cinfo.min_DCT_scaled_size;
+    int x0 = std::max(0, roi.x - iMCUWidth), x1 = std::min<int>(roi.br().x + iMCUWidth, cinfo.output_width);
+    xOffset = x0;
+    width = x1 - x0;
+    jpeg_crop_scanline(&cinfo, &xOffset, &width);
+    if (roi.y > 0) jpeg_skip_scanlines(&cinfo, roi.y);
+    return true;
+}
+
+/*
+* Decode the rows of the region started with startJpeg, then destroy the decompressor
+* @param decoder: started decompressor
+* @param firstRow, lastRow: rows of the region, lastRow excluded
+* @param out, step: preallocated rows of the cropped width
+* @return false on errors
+*/
+bool readJpegRows(JpegDecoder& decoder, int firstRow, int lastRow, uchar* out, size_t step)
+{
+    auto& cinfo = decoder.cinfo;
+    if (setjmp(decoder.error.jump))
+    {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    while (cinfo.output_scanline < static_cast<JDIMENSION>(lastRow))
+    {
+        JSAMPROW row = out + (cinfo.output_scanline - firstRow) * step;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    // Rows below the region are not needed
+    jpeg_abort_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+/*
+* Decode a JPEG with libjpeg-turbo, at reduced resolution or only a region at full resolution
+* @param data: JPEG file content
+* @param searchSize: if roi is empty, the whole image is decoded with the largest reduction keeping 2 * searchSize pixels on its short side
+* @param roi: region to decode at full resolution
+* @param out: output BGR image
+* @param reduction: output reduction
+* @param size: full resolution size
+* @return false if the image cannot be decoded here (errors, EXIF rotations)
+*/
+bool decodeJpeg(const std::vector<uchar>& data, int searchSize, cv::Rect roi, cv::Mat& out, int& reduction, cv::Size& size)
+{
+    // The output is allocated between the two libjpeg steps, out of reach of their longjmp
+    JpegDecoder decoder;
+    JDIMENSION xOffset, width;
+    if (!startJpeg(decoder, data, searchSize, roi, xOffset, width, reduction, size)) return false;
+    cv::Mat decoded(roi.height, width, CV_8UC3);
+    if (!readJpegRows(decoder, roi.y, roi.br().y, decoded.data, decoded.step)) return false;
+    out = decoded.colRange(roi.x - xOffset, roi.x - xOffset + roi.width);
+    return true;
+}
+
+#else
+
+bool decodeJpeg(const std::vector<uchar>&, int, cv::Rect, cv::Mat&, int&, cv::Size&)
+{
+    return false;
+}
+
+#endif
+
+ImageSource::ImageSource(const cv::Mat& img) : mImage(img), mSize(img.size())
+{
+}
+
+ImageSource ImageSource::decode(std::vector<uchar> encoded, int searchSize)
+{
+    ImageSource source;
+    bool jpeg = encoded.size() > 2 && encoded[0] == 0xFF && encoded[1] == 0xD8;
+    if (jpeg && decodeJpeg(encoded, searchSize, cv::Rect(), source.mImage, source.mReduction, source.mSize))
+    {
+        if (source.mReduction > 1) source.mEncoded = std::make_shared<const std::vector<uchar>>(std::move(encoded));
+        return source;
+    }
+
+    // Other formats (and JPEGs libjpeg-turbo can't handle) at full resolution
+    return ImageSource(cv::imdecode(encoded, cv::IMREAD_COLOR));
+}
+
+ImageSource ImageSource::read(const std::string& path, int searchSize)
+{
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    if (!file)
+    {
+        LOG("Cannot open image: " << path);
+        return {};
+    }
+    std::vector<uchar> encoded((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return decode(std::move(encoded), searchSize);
+}
+
+cv::Rect ImageSource::toFull(const cv::Rect& rect) const
+{
+    return cv::Rect(rect.x * mReduction, rect.y * mReduction, rect.width * mReduction, rect.height * mReduction) & cv::Rect(cv::Point(0, 0), mSize);
+}
+
+cv::Mat ImageSource::region(const cv::Rect& roi) const
+{
+    cv::Rect clipped = roi & cv::Rect(cv::Point(0, 0), mSize);
+    if (!mEncoded || clipped.empty()) return mImage(clipped);
+
+    cv::Mat out;
+    int reduction;
+    cv::Size size;
+    if (!decodeJpeg(*mEncoded, 0, clipped, out, reduction, size))
+    {
+        // The reduced decode worked, so this should not happen
+        LOG("Cannot decode image region " << clipped);
+        return cv::imdecode(*mEncoded, cv::IMREAD_COLOR)(clipped);
+    }
+    return out;
+}
+
+}
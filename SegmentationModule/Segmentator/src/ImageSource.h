@@ -0,0 +1,75 @@
+#ifndef __IMAGESOURCE_H_
+#define __IMAGESOURCE_H_
+
+#include <opencv2/core.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace erb
+{
+
+/*
+* Input image of a segmentation.
+* Eye detection and circles search only need a low resolution image, so JPEG files are decoded
+* at a reduced resolution (DCT scaling) and full resolution pixels are decoded only for the
+* regions asked with region(), i.e. the eye crop that is normalized.
+* Other formats, or builds without libjpeg-turbo, are decoded once at full resolution.
+*/
+class ImageSource
+{
+public:
+    ImageSource() = default;
+    /*
+    * Wrap an image that is already decoded, it's not copied
+    * @param img: input image
+    */
+    explicit ImageSource(const cv::Mat& img);
+
+    /*
+    * Decode an image file content
+    * @param encoded: encoded image
+    * @param searchSize: size of the circles search image, the reduced image keeps at least
+    *                    twice this size on its short side so that eye crops down to half of it can be searched
+    * @return decoded image, empty if it cannot be decoded
+    */
+    static ImageSource decode(std::vector<uchar> encoded, int searchSize);
+    /*
+    * Read and decode an image file
+    * @param path: image path
+    * @param searchSize: size of the circles search image, see decode
+    * @return decoded image, empty if it cannot be read
+    */
+    static ImageSource read(const std::string& path, int searchSize);
+
+    inline bool empty() const { return mImage.empty(); }
+    // Image at reduced resolution (BGR if decoded here)
+    inline const cv::Mat& image() const { return mImage; }
+    // image() is the full resolution image scaled by 1 / reduction (1, 2, 4 or 8)
+    inline int reduction() const { return mReduction; }
+    // Full resolution size
+    inline cv::Size size() const { return mSize; }
+
+    /*
+    * Convert a rectangle of image() to full resolution coordinates
+    * @param rect: rectangle in image() coordinates
+    * @return rectangle covering the same pixels at full resolution, clipped to the image
+    */
+    cv::Rect toFull(const cv::Rect& rect) const;
+    /*
+    * Full resolution pixels of a region, decoded on every call if image() is reduced
+    * @param roi: region in full resolution coordinates, clipped to the image
+    * @return region pixels
+    */
+    cv::Mat region(const cv::Rect& roi) const;
+private:
+    cv::Mat mImage;
+    int mReduction = 1;
+    cv::Size mSize;
+    // JPEG file content, only kept when image() is reduced
+    std::shared_ptr<const std::vector<uchar>> mEncoded;
+};
+
+}
+#endif // !__IMAGESOURCE_H_
@@ -1,23 +1,24 @@
 #include "IsisSegmentator.h"
+#include "Isis/TaubinFit.h"
 #include "ImagePreproc.h"
 
 #include <algorithm>
-#include <execution>
+#include <cstdint>
+#include <unordered_map>
 
 
 namespace isis
 {
-IsisSegmentator::IsisSegmentator(int finalSize) : mFinalSize(finalSize)
+IsisSegmentator::IsisSegmentator(int finalSize, std::shared_ptr<const EyeDetector> eyeDetector) : Segmentator(std::move(eyeDetector)), mFinalSize(finalSize)
 {
 }
 
-SegmentationData IsisSegmentator::Segment(const cv::Mat& src) const
+SegmentationData IsisSegmentator::Segment(const ImageSource& src, int outputs) const
 {
 	SegmentationData record;
 	cv::Mat img;
-	src.copyTo(img);
 
-	auto preprocessInfo = preprocessImage(img, img, mFinalSize);
+	auto preprocessInfo = preprocessImage(src, img, mFinalSize, *mEyeDetector);
 	if (!preprocessInfo.crop.success)
 	{
 		LOG("Crop failed");
@@ -42,9 +43,9 @@ SegmentationData IsisSegmentator::Segment(const cv::Mat& src) const
 	iris.limbus = TransformCircle(iris.limbus, preprocessInfo.scale.to, preprocessInfo.scale.from);
 	iris.pupil = TransformCircle(iris.pupil, preprocessInfo.scale.to, preprocessInfo.scale.from);
 
-	img = src(preprocessInfo.crop.roi);
+	img = src.region(preprocessInfo.crop.roi);
 
-	record.irisNormalized = normalizeIris(img, iris);
+	record.irisNormalized = normalizeIris(img, iris, mNormalizationParams, outputs);
 	
 	return record;
 }
@@ -63,159 +64,99 @@ struct CircleSearchRecord
 	double score = 0;
 };
 
-void canny(const cv::Mat& src, cv::Mat& out, double cannyThreshold)
+// Scores (homogeneity + separability) of the candidate circles of one search:
+// the same circle is found at many posterization levels and thresholds, but it's scored once
+class CircleScores
 {
-	cv::Mat blurred;
-	src.copyTo(blurred);
-
-	cv::medianBlur(blurred, blurred, 3);
-	cv::equalizeHist(blurred, blurred);
-	cv::Canny(blurred, out, cannyThreshold, cannyThreshold * 3, 5);
-}
-
-Circle taubin(const std::vector<cv::Point>& contour)
-{
-	cv::Point2d sum = { 0,0 };
-	for (const cv::Point& p : contour)
-	{
-		sum.x += p.x;
-		sum.y += p.y;
-	}
-
-	cv::Point2d mean = { sum.x / contour.size(), sum.y / contour.size() };
-	// Mxx = 0, Myy = 1, Mxy = 2, Mxz = 3, Myz = 4, Mzz = 5
-	double m[] = { 0., 0., 0., 0., 0., 0. };
-
-	double xi, yi, zi;
-	for (const cv::Point& p : contour)
+public:
+	explicit CircleScores(const cv::Mat& mat) : mMat(mat) {}
+
+	/**
+	 * Score circles, only the ones never seen before are computed
+	 *
+	 * @param circles Candidate circles
+	 * @return score of every circle
+	 */
+	std::vector<double> operator()(const std::vector<Circle>& circles)
 	{
-		xi = p.x - mean.x;
-		yi = p.y - mean.y;
-		zi = cv::pow(xi, 2) + cv::pow(yi, 2);
-
-		// Mxy
-		m[2] += xi * yi;
-		// Mxx
-		m[0] += cv::pow(xi, 2);
-		// Myy
-		m[1] += cv::pow(yi, 2);
-		// Mxz
-		m[3] += xi * zi;
-		// Myz
-		m[4] += yi * zi;
-		// Mzz
-		m[5] += cv::pow(zi, 2);
-
+		scored += circles.size();
+		// Circles not in the cache, every one once
+		std::vector<Circle> fresh;
+		for (const auto& circle : circles)
+			if (mScores.emplace(key(circle), 0.).second) fresh.push_back(circle);
+		unique += fresh.size();
+
+		auto homogeneityScores = homogeneity(mMat, fresh);
+		auto separabilityScores = separability(mMat, fresh);
+		for (size_t i = 0; i < fresh.size(); i++)
+			mScores[key(fresh[i])] = homogeneityScores[i] + separabilityScores[i];
+
+		std::vector<double> scores;
+		scores.reserve(circles.size());
+		for (const auto& circle : circles) scores.push_back(mScores[key(circle)]);
+		return scores;
 	}
 
-	for (int i = 0; i < 6; i++) m[i] /= contour.size();
-
-	// coeff
-	double  mz = m[0] + m[1],
-		cov_xy = m[0] * m[1] - cv::pow(m[2], 2),
-		var_z = m[5] - cv::pow(mz, 2),
-		a3 = 4. * mz,
-		a2 = -3. * cv::pow(mz, 2) - m[5],
-		a1 = var_z * mz + 4. * cov_xy * mz - cv::pow(m[3], 2) - cv::pow(m[4], 2),
-		a0 = m[3] * (m[3] * m[1] - m[4] * m[2]) + m[4] * (m[4] * m[0] - m[3] * m[2]) - var_z * cov_xy,
-		a22 = 2. * a2,
-		a33 = a3 * 3.,
-		x = 0.,
-		y = a0;
-
-	for (int i = 0; i < 99; i++)
+	// Candidates found, candidates scored (repeated ones included) and circles actually scored
+	size_t generated = 0, scored = 0, unique = 0;
+private:
+	// Circles are inside the image, 21 bits for each value are plenty
+	static uint64_t key(const Circle& c)
 	{
-		double dy = a1 + x * (a22 + a33 * x);
-		double xnew = x - y / dy;
-		if ((xnew == x) || (!(xnew < std::numeric_limits<double>::max()))) break;
-
-		double ynew = a0 + xnew * (a1 + xnew * (a2 + xnew * a3));
-		if (cv::abs(ynew) >= cv::abs(y)) break;
-
-		x = xnew;
-		y = ynew;
+		auto bits = [](int v) { return static_cast<uint64_t>(v) & 0x1FFFFF; };
+		return bits(c.center[0]) << 42 | bits(c.center[1]) << 21 | bits(c.radius);
 	}
 
-	double det = cv::pow(x, 2) - x * mz + cov_xy,
-		xcenter = (m[3] * (m[1] - x) - m[4] * m[2]) / det / 2.,
-		ycenter = (m[4] * (m[0] - x) - m[3] * m[2]) / det / 2.;
-
-	double radius = cv::sqrt(cv::pow(xcenter, 2) + cv::pow(ycenter, 2) + mz);
-	return Circle{ static_cast<int>(radius), cv::Vec2i(xcenter + mean.x, ycenter + mean.y) };
-
-}
+	cv::Mat mMat;
+	std::unordered_map<uint64_t, double> mScores;
+};
 
 void findCirclesTaubin(const cv::Mat& mat, std::vector<Circle>& outputCircles, double minRadius, double maxRadius)
 {
 	outputCircles = std::vector<Circle>();
 	std::vector<double> cth = { 0.05, 0.1, 0.15, 0.20, 0.25, 0.30, 0.35, 0.40, 0.45, 0.50 };
-	for (auto cannyThreshold : cth)
-	{
-		cv::Mat cannyRes;
-		canny(mat, cannyRes, cannyThreshold);
+	std::vector<cv::Vec2d> thresholds;
+	for (auto cannyThreshold : cth) thresholds.push_back({ cannyThreshold, cannyThreshold * 3 });
 
+	// Smoothing doesn't depend on the threshold: blur and equalize once, then sweep the thresholds
+	cv::Mat blurred;
+	cv::medianBlur(mat, blurred, 3);
+	cv::equalizeHist(blurred, blurred);
+	auto edgeMaps = cannyBank(blurred, thresholds, 5);
+
+	for (auto& cannyRes : edgeMaps)
+	{
 		std::vector<std::vector<cv::Point>> contours;
 		std::vector<cv::Vec4i> hierarchy;
 		cv::findContours(cannyRes, contours, hierarchy, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_TC89_KCOS);
 		
-		#ifdef USE_PARALLEL_ALGORITHM
-		std::mutex m;
-		std::for_each(std::execution::par, contours.begin(), contours.end(), [&](auto& contour)
-		{
-			// controlla cerchio
-			if (contour.size() <= 5) return;
-			Circle circle = taubin(contour);
-
-			if (circle.inside(mat) && circle.radius >= minRadius && circle.radius <= maxRadius)
-			{
-				std::lock_guard<std::mutex> guard(m);
-				outputCircles.push_back(circle);
-			}
-		});
-		#else
-		for(const auto& contour : contours)
+		// Fit all the contours at once
+		ContourPoints points(contours);
+		auto fits = taubin(points);
+		for (size_t i = 0; i < fits.size(); i++)
 		{
 			// controlla cerchio
-			if (contour.size() <= 5) return;
-			Circle circle = taubin(contour);
+			if (points.size(i) <= 5 || !fits[i].isValid()) continue;
+			const Circle& circle = fits[i].circle;
 
 			if (circle.inside(mat) && circle.radius >= minRadius && circle.radius <= maxRadius)
-			{
 				outputCircles.push_back(circle);
-			}
 		}
-		#endif
 	}
 }
 
-CircleSearchRecord findLimbus(const cv::Mat& mat, const std::vector<Circle>& circles)
+CircleSearchRecord findLimbus(CircleScores& circleScores, const std::vector<Circle>& circles)
 {
 	CircleSearchRecord bestCircle;
-	#ifdef USE_PARALLEL_ALGORITHM
-	std::mutex m;
-	std::for_each(std::execution::par, circles.begin(), circles.end(), [&](auto& circle)
+	// homogeneity + separability, repeated circles are looked up
+	auto scores = circleScores(circles);
+	// The best one is picked in order
+	for (size_t i = 0; i < circles.size(); i++)
 	{
-		// homogeneity
-		double homogeneityScore = homogeneity(mat, circle);
-		// separability
-		double separabilityScore = separability(mat, circle);
-		double score = homogeneityScore + separabilityScore;
-		std::lock_guard<std::mutex> guard(m);
+		double score = scores[i];
 		if (bestCircle.circle.radius == 0 || bestCircle.score < score)
-			bestCircle = { circle, score };
-	});
-	#else
-	for(const auto& circle : circles)
-	{
-		// homogeneity
-		double homogeneityScore = homogeneity(mat, circle);
-		// separability
-		double separabilityScore = separability(mat, circle);
-		double score = homogeneityScore + separabilityScore;
-		if (bestCircle.circle.radius == 0 || bestCircle.score < score)
-			bestCircle = { circle, score };
+			bestCircle = { circles[i], score };
 	}
-	#endif
 	return bestCircle;
 }
 
@@ -224,52 +165,42 @@ Circle IsisSegmentator::LimbusCircle(const cv::Mat& img) const
 	cv::Mat tmpColor;
 	CircleSearchRecord bestLimbus;
 	int size = img.rows;
-	for (int k = 1; k < 18; k++)
+	// all posterization levels k = 1..17
+	auto posterizedBank = posterizationBank(img, 1, 17);
+	CircleScores circleScores(img);
+	for (const cv::Mat& posterized : posterizedBank)
 	{
-		cv::Mat posterized;
-		posterization(img, posterized, k);
 		cv::cvtColor(posterized, tmpColor, cv::COLOR_GRAY2BGR);
 		std::vector<Circle> circles;
 		findCirclesTaubin(posterized, circles, size * 0.15, size * 0.5);
+		circleScores.generated += circles.size();
 		if (circles.empty()) continue;
 		// find best limbus
-		auto bestKLimbus = findLimbus(img, circles);
+		auto bestKLimbus = findLimbus(circleScores, circles);
 
 		if (bestLimbus.circle.radius == 0 || bestLimbus.score < bestKLimbus.score)
 			bestLimbus = bestKLimbus;
 	}
+	LOG("Limbus candidates: " << circleScores.generated << " generated, " << circleScores.scored << " scored, " << circleScores.unique << " unique");
 
 	return bestLimbus.circle;
 }
 
-CircleSearchRecord findPupil(const cv::Mat& mat, std::vector<Circle>& circles, const Circle& limbus)
+CircleSearchRecord findPupil(const cv::Mat& mat, CircleScores& circleScores, std::vector<Circle>& circles, const Circle& limbus)
 {
 	CircleSearchRecord bestCircle;
 
 	Circle defaultCircle = Circle{ static_cast<int>(limbus.radius / 4.f), cv::Vec2i(mat.cols / 2, mat.rows / 2) };
 	circles.push_back(defaultCircle);
-	#ifdef USE_PARALLEL_ALGORITHM
-	std::mutex m;
-	std::for_each(std::execution::par, circles.begin(), circles.end(), [&](auto& c)
+	// homogeneity + separability, repeated circles are looked up
+	auto scores = circleScores(circles);
+	// The best one is picked in order
+	for (size_t i = 0; i < circles.size(); i++)
 	{
-		double homogeneityScore = homogeneity(mat, c);
-		double separabilityScore = separability(mat, c);
-		double score = homogeneityScore + separabilityScore;
-		std::lock_guard<std::mutex> guard(m);
-		if (score > bestCircle.score) bestCircle = { c, score };
-	});
-	#else
-	for(const auto& c : circles)
-	{
-		double homogeneityScore = homogeneity(mat, c);
-		double separabilityScore = separability(mat, c);
-		double score = homogeneityScore + separabilityScore;
-
-		if (score > bestCircle.score) bestCircle = { c, score };
+		if (scores[i] > bestCircle.score) bestCircle = { circles[i], scores[i] };
 	}
-	#endif
 	if (bestCircle.circle.radius == 0)
-		bestCircle = { defaultCircle, homogeneity(mat, defaultCircle) + separability(mat, defaultCircle) };
+		bestCircle = { defaultCircle, scores.back() };
 
 	return bestCircle;
 }
@@ -279,24 +210,27 @@ Circle IsisSegmentator::PupilCircle(const cv::Mat& img, const Circle& limbus) co
 	CircleSearchRecord bestPupil;
 	cv::Mat limbusCropped = img(limbus.getbbox());
 	auto centerCrop = cv::Point(limbusCropped.cols / 2, limbusCropped.rows / 2);
-	for (int k = 1; k < 18; k++)
+	// all posterization levels k = 1..17
+	auto posterizedBank = posterizationBank(limbusCropped, 1, 17);
+	CircleScores circleScores(limbusCropped);
+	for (const cv::Mat& posterized : posterizedBank)
 	{
-		cv::Mat posterized;
-		posterization(limbusCropped, posterized, k);
 
 		std::vector<Circle> circles;
 		findCirclesTaubin(posterized, circles, 0.1 * limbusCropped.rows, 0.2 * limbusCropped.rows);
-
-		for (int i = (int)circles.size() - 1; i >= 0; i--)
-		{
-			if (mean(posterized, circles[i]) > 40.0
-				|| !circles[i].inside(centerCrop.x, centerCrop.y)
-				|| distance(circles[i].center, centerCrop) > 0.05 * limbusCropped.rows
-				)
-				circles.erase(circles.begin() + i);
-		}
-
-		auto bestKPupil = findPupil(limbusCropped, circles, limbus);
+		circleScores.generated += circles.size();
+
+		// Keep centered circles, then the dark ones (means of all the centered circles in one call)
+		circles.erase(std::remove_if(circles.begin(), circles.end(), [&](const Circle& c) {
+			return !c.inside(centerCrop.x, centerCrop.y) || distance(c.center, centerCrop) > 0.05 * limbusCropped.rows;
+		}), circles.end());
+		auto means = mean(posterized, circles);
+		std::vector<Circle> darkCircles;
+		for (size_t i = 0; i < circles.size(); i++)
+			if (!(means[i] > 40.0)) darkCircles.push_back(circles[i]);
+		circles = std::move(darkCircles);
+
+		auto bestKPupil = findPupil(limbusCropped, circleScores, circles, limbus);
 		const auto tmp = bestKPupil.circle;
 
 		bestKPupil = { Circle{tmp.radius, cv::Vec2i(tmp.center[0] + limbus.getbbox().x, tmp.center[0] + limbus.getbbox().y)},
@@ -305,6 +239,7 @@ Circle IsisSegmentator::PupilCircle(const cv::Mat& img, const Circle& limbus) co
 
 		if (bestPupil.circle.radius == 0 || bestPupil.score < bestKPupil.score) bestPupil = bestKPupil;
 	}
+	LOG("Pupil candidates: " << circleScores.generated << " generated, " << circleScores.scored << " scored, " << circleScores.unique << " unique");
 
 	return bestPupil.circle;
 }
@@ -10,14 +10,21 @@ using namespace erb;
 class IsisSegmentator : public Segmentator
 {
 public:
-	IsisSegmentator(int finalSize = 500);
+	/**
+	 * @param finalSize Size of the scaled image used for circles search
+	 * @param eyeDetector Eye detector used for cropping, if null a new one is loaded
+	 */
+	IsisSegmentator(int finalSize = 500, std::shared_ptr<const EyeDetector> eyeDetector = nullptr);
+	using Segmentator::Segment;
 	/**
 	 * Segment iris image
 	 *
-	 * @param img Iris image
+	 * @param src Iris image, the circles are searched at its reduced resolution
+	 * @param outputs NormalizationOutput bitmask of the normalized images to produce
 	 * @return SegmentationData struct containing all segmentation informations: limbus and pupil circle, normalization data, etc..
 	 */
-	SegmentationData Segment(const cv::Mat& img) const override;
+	SegmentationData Segment(const ImageSource& src, int outputs = NORMALIZED_ALL) const override;
+	inline int searchSize() const override { return mFinalSize; }
 // Private methods
 private:
 	/**
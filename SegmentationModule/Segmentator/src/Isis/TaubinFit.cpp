@@ -0,0 +1,223 @@
+#include "Isis/TaubinFit.h"
+#include "Execution.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ERB_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace isis
+{
+
+ContourPoints::ContourPoints(const std::vector<std::vector<cv::Point>>& contours)
+{
+	offsets.resize(contours.size() + 1);
+	for (size_t i = 0; i < contours.size(); i++) offsets[i + 1] = offsets[i] + contours[i].size();
+	x.resize(offsets.back());
+	y.resize(offsets.back());
+	for (size_t i = 0; i < contours.size(); i++)
+	{
+		int* px = x.data() + offsets[i];
+		int* py = y.data() + offsets[i];
+		for (const cv::Point& p : contours[i])
+		{
+			*px++ = p.x;
+			*py++ = p.y;
+		}
+	}
+}
+
+// Raw moments of a contour about its first point, sums of x^i * y^j
+enum Moment { S_X, S_Y, S_XX, S_XY, S_YY, S_XXX, S_XXY, S_XYY, S_YYY, S_XXXX, S_XXYY, S_YYYY, MOMENTS };
+
+// Raw moments of a contour
+using MomentsFn = void (*)(const int* x, const int* y, size_t n, double sums[MOMENTS]);
+
+/**
+ * Add the raw moments of the points [begin, n) of a contour.
+ * Coordinates are shifted to the first point: they stay as small as the contour and every
+ * product and sum is an integer below 2^53, so sums are exact whatever the order.
+ *
+ * @param x Contour abscissas
+ * @param y Contour ordinates
+ * @param begin First point
+ * @param n Number of points
+ * @param sums Moments to update
+ */
+void addMoments(const int* x, const int* y, size_t begin, size_t n, double sums[MOMENTS])
+{
+	const int x0 = x[0], y0 = y[0];
+	for (size_t i = begin; i < n; i++)
+	{
+		double dx = x[i] - x0, dy = y[i] - y0;
+		double xx = dx * dx, xy = dx * dy, yy = dy * dy;
+		sums[S_X] += dx;
+		sums[S_Y] += dy;
+		sums[S_XX] += xx;
+		sums[S_XY] += xy;
+		sums[S_YY] += yy;
+		sums[S_XXX] += xx * dx;
+		sums[S_XXY] += xx * dy;
+		sums[S_XYY] += xy * dy;
+		sums[S_YYY] += yy * dy;
+		sums[S_XXXX] += xx * xx;
+		sums[S_XXYY] += xx * yy;
+		sums[S_YYYY] += yy * yy;
+	}
+}
+
+// Raw moments of a contour in one pass
+void momentsScalar(const int* x, const int* y, size_t n, double sums[MOMENTS])
+{
+	std::fill(sums, sums + MOMENTS, 0.);
+	addMoments(x, y, 0, n, sums);
+}
+
+#ifdef ERB_X86_SIMD
+
+__attribute__((target("avx2")))
+void momentsAvx2(const int* x, const int* y, size_t n, double sums[MOMENTS])
+{
+	const __m128i x0 = _mm_set1_epi32(x[0]), y0 = _mm_set1_epi32(y[0]);
+	__m256d acc[MOMENTS];
+	for (int m = 0; m < MOMENTS; m++) acc[m] = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256d dx = _mm256_cvtepi32_pd(_mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)), x0));
+		__m256d dy = _mm256_cvtepi32_pd(_mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i)), y0));
+		__m256d xx = _mm256_mul_pd(dx, dx), xy = _mm256_mul_pd(dx, dy), yy = _mm256_mul_pd(dy, dy);
+		acc[S_X] = _mm256_add_pd(acc[S_X], dx);
+		acc[S_Y] = _mm256_add_pd(acc[S_Y], dy);
+		acc[S_XX] = _mm256_add_pd(acc[S_XX], xx);
+		acc[S_XY] = _mm256_add_pd(acc[S_XY], xy);
+		acc[S_YY] = _mm256_add_pd(acc[S_YY], yy);
+		acc[S_XXX] = _mm256_add_pd(acc[S_XXX], _mm256_mul_pd(xx, dx));
+		acc[S_XXY] = _mm256_add_pd(acc[S_XXY], _mm256_mul_pd(xx, dy));
+		acc[S_XYY] = _mm256_add_pd(acc[S_XYY], _mm256_mul_pd(xy, dy));
+		acc[S_YYY] = _mm256_add_pd(acc[S_YYY], _mm256_mul_pd(yy, dy));
+		acc[S_XXXX] = _mm256_add_pd(acc[S_XXXX], _mm256_mul_pd(xx, xx));
+		acc[S_XXYY] = _mm256_add_pd(acc[S_XXYY], _mm256_mul_pd(xx, yy));
+		acc[S_YYYY] = _mm256_add_pd(acc[S_YYYY], _mm256_mul_pd(yy, yy));
+	}
+
+	// Last points
+	double tail[MOMENTS] = {};
+	addMoments(x, y, i, n, tail);
+
+	for (int m = 0; m < MOMENTS; m++)
+	{
+		double lanes[4];
+		_mm256_storeu_pd(lanes, acc[m]);
+		sums[m] = lanes[0] + lanes[1] + lanes[2] + lanes[3] + tail[m];
+	}
+}
+
+#endif
+
+// Best moments kernel for this cpu, chosen once
+MomentsFn moments()
+{
+	static const MomentsFn fn = []() -> MomentsFn {
+#ifdef ERB_X86_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) return momentsAvx2;
+#endif
+		return momentsScalar;
+	}();
+	return fn;
+}
+
+/**
+ * Taubin fit of one contour
+ *
+ * @param x Contour abscissas
+ * @param y Contour ordinates
+ * @param n Number of points
+ * @return fitted circle
+ */
+CircleFit taubin(const int* x, const int* y, size_t n)
+{
+	if (n == 0) return { {}, std::numeric_limits<double>::infinity() };
+	double s[MOMENTS];
+	moments()(x, y, n, s);
+	for (double& v : s) v /= n;
+
+	// Centroid, relative to the first point
+	double mx = s[S_X], my = s[S_Y];
+	double mx2 = mx * mx, my2 = my * my;
+
+	// Centered moments (z = x^2 + y^2): Mxx = 0, Myy = 1, Mxy = 2, Mxz = 3, Myz = 4, Mzz = 5
+	double m[6];
+	m[0] = s[S_XX] - mx2;
+	m[1] = s[S_YY] - my2;
+	m[2] = s[S_XY] - mx * my;
+	m[3] = (s[S_XXX] - 3. * mx * s[S_XX] + 2. * mx2 * mx)
+		+ (s[S_XYY] - 2. * my * s[S_XY] - mx * s[S_YY] + 2. * mx * my2);
+	m[4] = (s[S_YYY] - 3. * my * s[S_YY] + 2. * my2 * my)
+		+ (s[S_XXY] - 2. * mx * s[S_XY] - my * s[S_XX] + 2. * my * mx2);
+	double x4 = s[S_XXXX] - 4. * mx * s[S_XXX] + 6. * mx2 * s[S_XX] - 3. * mx2 * mx2;
+	double y4 = s[S_YYYY] - 4. * my * s[S_YYY] + 6. * my2 * s[S_YY] - 3. * my2 * my2;
+	double x2y2 = s[S_XXYY] - 2. * my * s[S_XXY] - 2. * mx * s[S_XYY] + my2 * s[S_XX] + mx2 * s[S_YY]
+		+ 4. * mx * my * s[S_XY] - 3. * mx2 * my2;
+	m[5] = x4 + 2. * x2y2 + y4;
+
+	// coeff
+	double  mz = m[0] + m[1],
+		cov_xy = m[0] * m[1] - m[2] * m[2],
+		var_z = m[5] - mz * mz,
+		a3 = 4. * mz,
+		a2 = -3. * mz * mz - m[5],
+		a1 = var_z * mz + 4. * cov_xy * mz - m[3] * m[3] - m[4] * m[4],
+		a0 = m[3] * (m[3] * m[1] - m[4] * m[2]) + m[4] * (m[4] * m[0] - m[3] * m[2]) - var_z * cov_xy,
+		a22 = 2. * a2,
+		a33 = a3 * 3.,
+		xr = 0.,
+		yr = a0;
+
+	// Newton, from 0
+	for (int i = 0; i < 99; i++)
+	{
+		double dy = a1 + xr * (a22 + a33 * xr);
+		double xnew = xr - yr / dy;
+		if ((xnew == xr) || (!(xnew < std::numeric_limits<double>::max()))) break;
+
+		double ynew = a0 + xnew * (a1 + xnew * (a2 + xnew * a3));
+		if (std::abs(ynew) >= std::abs(yr)) break;
+
+		xr = xnew;
+		yr = ynew;
+	}
+
+	double det = xr * xr - xr * mz + cov_xy,
+		xcenter = (m[3] * (m[1] - xr) - m[4] * m[2]) / det / 2.,
+		ycenter = (m[4] * (m[0] - xr) - m[3] * m[2]) / det / 2.;
+	double radius2 = xcenter * xcenter + ycenter * ycenter + mz;
+	if (!std::isfinite(xcenter) || !std::isfinite(ycenter) || !(radius2 > 0))
+		return { {}, std::numeric_limits<double>::infinity() };
+	double radius = std::sqrt(radius2);
+
+	// Mean squared algebraic distance (|p - c|^2 - r^2)^2 from the same moments, it's about (2r)^2 times the geometric one
+	double algebraic = m[5] - mz * mz + 4. * (xcenter * xcenter * m[0] + ycenter * ycenter * m[1] + 2. * xcenter * ycenter * m[2])
+		- 4. * (xcenter * m[3] + ycenter * m[4]);
+	double residual = std::sqrt(std::max(0., algebraic)) / (2. * radius);
+
+	return { Circle{ static_cast<int>(radius), cv::Vec2i(xcenter + mx + x[0], ycenter + my + y[0]) }, residual };
+}
+
+std::vector<CircleFit> taubin(const ContourPoints& points)
+{
+	std::vector<CircleFit> fits(points.contours());
+	parallelFor(fits.size(), [&](size_t i)
+	{
+		size_t begin = points.offsets[i];
+		fits[i] = taubin(points.x.data() + begin, points.y.data() + begin, points.size(i));
+	});
+	return fits;
+}
+
+}
@@ -0,0 +1,48 @@
+#ifndef __TAUBINFIT_H_
+#define __TAUBINFIT_H_
+
+#include "Util.h"
+
+#include <cmath>
+#include <vector>
+
+namespace isis
+{
+using namespace erb;
+
+// Contours of one findContours call as a flat point buffer
+struct ContourPoints
+{
+	// Point coordinates, structure of arrays
+	std::vector<int> x, y;
+	// Points of contour i are [offsets[i], offsets[i + 1])
+	std::vector<size_t> offsets = { 0 };
+
+	ContourPoints() = default;
+	explicit ContourPoints(const std::vector<std::vector<cv::Point>>& contours);
+
+	inline size_t contours() const { return offsets.size() - 1; }
+	inline size_t size(size_t contour) const { return offsets[contour + 1] - offsets[contour]; }
+};
+
+// Circle fitted to a contour
+struct CircleFit
+{
+	Circle circle;
+	// Root mean square distance of the points from the circle (approximated from the algebraic one), infinite for degenerate fits
+	double residual;
+
+	inline bool isValid() const { return std::isfinite(residual); }
+};
+
+/**
+ * Fit a circle to every contour with Taubin method (Newton based)
+ *
+ * @param points Contours points
+ * @return one fit for each contour
+ */
+std::vector<CircleFit> taubin(const ContourPoints& points);
+
+}
+
+#endif // !__TAUBINFIT_H_
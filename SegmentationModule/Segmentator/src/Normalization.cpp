@@ -3,31 +3,83 @@
 #include "Segmentation.h"
 #include "Util.h"
 
+#include <algorithm>
+#include <mutex>
+
 namespace erb {
 
 void gradientImage(const cv::Mat& src, cv::Mat& out, bool up)
 {
-    cv::Mat kernel = cv::Mat();
-    for (int y = 0; y < 10; y++)
+    // Same as filter2D with a 10x5 kernel: 4 rows of 1, 2 rows of 0 and 4 rows of -1 (opposite if !up),
+    // as a difference of two integer box sums. Borders are reflected like filter2D does
+    auto reflect = [](int p, int len) { return cv::borderInterpolate(p, len, cv::BORDER_REFLECT_101); };
+
+    // Sums of 5 pixels around each pixel of a row
+    cv::Mat rowSums(src.size(), CV_32S);
+    for (int y = 0; y < src.rows; y++)
+    {
+        const uchar* s = src.ptr<uchar>(y);
+        int* sums = rowSums.ptr<int>(y);
+        for (int x = 0; x < src.cols; x++)
+        {
+            int sum = 0;
+            if (x >= 2 && x + 2 < src.cols) sum = s[x - 2] + s[x - 1] + s[x] + s[x + 1] + s[x + 2];
+            else for (int dx = -2; dx <= 2; dx++) sum += s[reflect(x + dx, src.cols)];
+            sums[x] = sum;
+        }
+    }
+
+    // Rows y-5..y-2 minus rows y+1..y+4
+    out.create(src.size(), CV_8UC1);
+    int sign = up ? 1 : -1;
+    for (int y = 0; y < src.rows; y++)
     {
-        double v = 0;
-        if (y > 3 && y < 6) v = 0;
-        else if (y < 4) v = up ? 1 : -1;
-        else if (y > 5) v = up ? -1 : 1;
-        double tmp[] = { v, v, v, v, v };
-        kernel.push_back(cv::Mat(1, 5, CV_64F, tmp));
+        const int* above[4];
+        const int* below[4];
+        for (int k = 0; k < 4; k++)
+        {
+            above[k] = rowSums.ptr<int>(reflect(y - 5 + k, src.rows));
+            below[k] = rowSums.ptr<int>(reflect(y + 1 + k, src.rows));
+        }
+        uchar* o = out.ptr<uchar>(y);
+        for (int x = 0; x < src.cols; x++)
+        {
+            int v = (above[0][x] + above[1][x] + above[2][x] + above[3][x]) - (below[0][x] + below[1][x] + below[2][x] + below[3][x]);
+            o[x] = static_cast<uchar>(std::clamp(sign * v, 0, 255));
+        }
     }
-    cv::filter2D(src, out, -1, kernel, cv::Point(-1, -1));
 }
 
-void lashAttenuation(const cv::Mat& src, cv::Mat& out)
+cv::Rect eyelidBand(const cv::Size& size, const Circle& limbus, const Circle& pupil, bool up)
+{
+    int startCol = limbus.center[0] - limbus.radius;
+    int endCol = limbus.center[0] + limbus.radius;
+    // Rows from upperRow (excluded) to lowerRow (included)
+    int upperRow = up ? limbus.center[1] - limbus.radius : pupil.center[1] + pupil.radius;
+    int lowerRow = up ? pupil.center[1] - pupil.radius : limbus.center[1] + limbus.radius;
+    if (endCol < startCol || lowerRow <= upperRow) return {};
+    return cv::Rect(startCol, upperRow + 1, endCol - startCol + 1, lowerRow - upperRow) & cv::Rect(cv::Point(), size);
+}
+
+void lashAttenuation(const cv::Mat& eye, cv::Mat& out, const cv::Rect& roi)
 {
-    cv::Mat eyelashSmoothed;
-    cv::medianBlur(src, eyelashSmoothed, 11);
-    gradientImage(eyelashSmoothed, out, true);
+    if (roi.empty())
+    {
+        out.release();
+        return;
+    }
+    // Pixels the median (5) and gradient (5 rows, 2 columns, reflected at the image borders) windows reach from the roi
+    cv::Rect window = cv::Rect(roi.x - 7, roi.y - 10, roi.width + 14, roi.height + 20) & cv::Rect(cv::Point(), eye.size());
+
+    cv::Mat grayWindow, eyelashSmoothed, gradient;
+    if (eye.channels() > 1) cv::cvtColor(eye(window), grayWindow, cv::COLOR_BGR2GRAY);
+    else eye(window).copyTo(grayWindow);
+    cv::medianBlur(grayWindow, eyelashSmoothed, 11);
+    gradientImage(eyelashSmoothed, gradient, true);
+    gradient(roi - window.tl()).copyTo(out);
 }
 
-std::vector<cv::Point> findEyelidPoints(const cv::Mat& mat, const Circle& limbus, const Circle& pupil, bool up)
+std::vector<cv::Point> findEyelidPoints(const cv::Mat& gradient, const cv::Rect& roi, const Circle& limbus, const Circle& pupil, bool up)
 {
     auto points = std::vector<cv::Point>();
 
@@ -36,63 +88,106 @@ std::vector<cv::Point> findEyelidPoints(const cv::Mat& mat, const Circle& limbus
 
     points.reserve(abs(endCol - startCol) + 1);
 
-    int upperRow = up ? (int)(limbus.center[1] - limbus.radius) : (int)(pupil.center[1] + pupil.radius);
-    int lowerRow = up ? (int)(pupil.center[1] - pupil.radius) : (int)(limbus.center[1] + limbus.radius);
+    // Eyelid rows are not too close to the pupil
+    double pupilLimit = up ? pupil.center[1] - pupil.radius * 1.5 : pupil.center[1] + pupil.radius * 1.5;
 
-    for (int col = startCol; col <= endCol; col++)
+    // Best row of every column, rows are scanned from the pupil outwards and the first maximum is kept
+    std::vector<uchar> maxValue(roi.width, 0);
+    std::vector<int> targetRow(roi.width, 0);
+    for (int row = roi.y + roi.height - 1; row >= roi.y; row--)
     {
-        double maxValue = 0; int targetRow = 0;
-        for (int row = lowerRow; row > upperRow; row--)
+        if (up ? !(row < pupilLimit) : !(row > pupilLimit)) continue;
+        const uchar* g = gradient.ptr<uchar>(row - roi.y);
+        // Branch free, so that columns are compared in parallel
+        for (int x = 0; x < roi.width; x++)
         {
-            if (inside(mat.size(), cv::Point(col, row)))
-            {
-                double val = mat.at<uchar>(row, col);
-                if (val > maxValue && ((up && row < pupil.center[1] - pupil.radius * 1.5) || (!up && row > pupil.center[1] + pupil.radius * 1.5)))
-                {
-                    maxValue = val;
-                    targetRow = row;
-                }
-            }
+            bool better = g[x] > maxValue[x];
+            maxValue[x] = better ? g[x] : maxValue[x];
+            targetRow[x] = better ? row : targetRow[x];
         }
-        points.emplace_back(col, targetRow);
+    }
+
+    // Columns outside the image have no eyelid point
+    for (int col = startCol; col <= endCol; col++)
+    {
+        bool inRoi = col >= roi.x && col < roi.x + roi.width;
+        points.emplace_back(col, inRoi ? targetRow[col - roi.x] : 0);
     }
     return points;
 }
 
-void normalizeKrupicka(const cv::Mat& src, cv::Mat& out, const Circle& limbus, const Circle& pupil,
-    map<cv::Point, cv::Point>& mapCartPol, map<cv::Point, cv::Point>& mapPolCart)
+/*
+* Call fn(row, column, x, y) for each polar point (column = angle, row = radius) with the
+* cartesian point it samples, in double as the coordinates are rounded for nearest sampling
+*/
+template<typename Fn>
+void forEachPolarPoint(const Circle& limbus, const Circle& pupil, const cv::Size& size, Fn&& fn)
 {
-    //clear map
-    mapCartPol = map<cv::Point, cv::Point>();
-
-    int h = limbus.radius * 2;
-    int w = std::round(limbus.radius * 2 * M_PI);
-    out = cv::Mat::zeros(cv::Size(w, h), CV_8UC3);
-
+    int h = size.height, w = size.width;
     double thetaStep = (2. * M_PI) / w;
-    double xp, yp, xl, yl;
+    std::vector<double> xp(w), yp(w), xl(w), yl(w);
+    for (int ind = 0; ind < w; ind++)
+    {
+        double theta = 3. * M_PI / 2. + ind * thetaStep;
+        xp[ind] = pupil.center[0] + pupil.radius * std::cos(theta);
+        yp[ind] = pupil.center[1] + pupil.radius * std::sin(theta);
+        xl[ind] = limbus.center[0] + limbus.radius * std::cos(theta);
+        yl[ind] = limbus.center[1] + limbus.radius * std::sin(theta);
+    }
+
+    for (int j = 0; j < h; ++j)
+    {
+        double pas = (double)j / h;
+        for (int ind = 0; ind < w; ind++)
+            fn(j, ind, (1. - pas) * xl[ind] + pas * xp[ind], (1. - pas) * yl[ind] + pas * yp[ind]);
+    }
+}
 
-    int x, y, ind = 0;
+// Cartesian point sampled by each polar point, as a cv::remap map
+cv::Mat polarGrid(const Circle& limbus, const Circle& pupil, const cv::Size& size)
+{
+    cv::Mat grid(size, CV_32FC2);
+    forEachPolarPoint(limbus, pupil, size, [&](int j, int ind, double x, double y) {
+        grid.at<cv::Vec2f>(j, ind) = cv::Vec2f(x, y);
+    });
+    return grid;
+}
 
-    for (double i = 3. * M_PI / 2.; i < 2. * M_PI + 3. * M_PI / 2.; i += thetaStep)
+void normalizeKrupicka(const cv::Mat& src, cv::Mat& out, const Circle& limbus, const Circle& pupil, cv::Mat& polarMap,
+    const NormalizationParams& params)
+{
+    // Native resolution keeps one sample per limbus pixel
+    auto nativeSize = cv::Size(std::round(limbus.radius * 2 * M_PI), limbus.radius * 2);
+    auto size = params.size.empty() ? nativeSize : params.size;
+
+    // Polar (column, row) to cartesian (x, y) table, (-1, -1) if the point is outside the image
+    polarMap.create(size, CV_16SC2);
+    forEachPolarPoint(limbus, pupil, size, [&](int j, int ind, double xd, double yd) {
+        int x = std::round(xd);
+        int y = std::round(yd);
+        polarMap.at<cv::Vec2s>(j, ind) = inside(src.size(), cv::Point(x, y)) ? cv::Vec2s(x, y) : cv::Vec2s(-1, -1);
+    });
+
+    // Points outside the image are black
+    switch (params.sampling)
     {
-        xp = pupil.center[0] + pupil.radius * std::cos(i);
-        yp = pupil.center[1] + pupil.radius * std::sin(i);
-        xl = limbus.center[0] + limbus.radius * std::cos(i);
-        yl = limbus.center[1] + limbus.radius * std::sin(i);
-        for (int j = 0; j < h; ++j)
-        {
-            double pas = (double)j / h;
-            x = std::round((1. - pas) * xl + pas * xp);
-            y = std::round((1. - pas) * yl + pas * yp);
-            if (inside(src.size(), cv::Point(x, y)))
-            {
-                out.at<cv::Vec3b>(j, ind) = src.at<cv::Vec3b>(y, x);
-                mapCartPol[cv::Point(ind, j)] = cv::Point(x, y);
-                mapPolCart[cv::Point(x, y)] = cv::Point(ind, j);
-            }
-        }
-        ind++;
+    case NormalizationSampling::NEAREST:
+        cv::remap(src, out, polarMap, cv::Mat(), cv::INTER_NEAREST, cv::BORDER_CONSTANT, cv::Scalar());
+        break;
+    case NormalizationSampling::BILINEAR:
+        cv::remap(src, out, polarGrid(limbus, pupil, size), cv::Mat(), cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar());
+        break;
+    case NormalizationSampling::AREA:
+    {
+        // Supersample by an integer factor close to the native resolution, then average each block
+        int fx = std::max(1, (int)std::ceil((double)nativeSize.width / size.width));
+        int fy = std::max(1, (int)std::ceil((double)nativeSize.height / size.height));
+        cv::Mat supersampled;
+        cv::remap(src, supersampled, polarGrid(limbus, pupil, cv::Size(size.width * fx, size.height * fy)), cv::Mat(),
+            cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar());
+        cv::resize(supersampled, out, size, 0, 0, cv::INTER_AREA);
+    }
+        break;
     }
 }
 
@@ -104,9 +199,9 @@ void lowerEyelidMask(const cv::Mat& normalizedRedChannel, cv::Mat& lowerEyelidMa
 
     cv::Mat mask = cv::Mat::zeros(normalizedRedChannel.size(), CV_8UC1);
 
-    for (int y = 0; y <= normalizedRedChannel.rows / 2; ++y)
-        for (int x = normalizedRedChannel.cols / 4; x <= (3 * normalizedRedChannel.cols) / 4; ++x)
-            mask.at<int>(y, x) = 1;
+    int startCol = normalizedRedChannel.cols / 4, endCol = std::min((3 * normalizedRedChannel.cols) / 4 + 1, normalizedRedChannel.cols);
+    int endRow = std::min(normalizedRedChannel.rows / 2 + 1, normalizedRedChannel.rows);
+    mask(cv::Rect(startCol, 0, endCol - startCol, endRow)).setTo(cv::Scalar(1));
 
     cv::meanStdDev(normalizedRedChannel, meanArray, stdDevArray, mask);
     double mean = meanArray[0], stdDev = stdDevArray[0];
@@ -121,81 +216,128 @@ void lowerEyelidMask(const cv::Mat& normalizedRedChannel, cv::Mat& lowerEyelidMa
     }
 }
 
-void negativeMask(const cv::Mat& src, cv::Mat& out,
-    const Circle& limbus, const Circle& pupil,
+// Eyelid points have one point for each column from the first one: y of the point of column x, 0 if there is none
+int upperEyelidEdge(const std::vector<cv::Point>& upperEyelidPoints, int x)
+{
+    if (upperEyelidPoints.empty()) return 0;
+    int i = x - upperEyelidPoints.front().x;
+    return i >= 0 && i < static_cast<int>(upperEyelidPoints.size()) ? upperEyelidPoints[i].y : 0;
+}
+
+void negativeMask(const cv::Size& size, cv::Mat& out,
+    const Circle& limbus,
     const std::vector<cv::Point>& upperEyelidPoints,
-    const cv::Mat& lowerEyelidMask,
-    const cv::Mat& reflectionsMask,
-    const map<cv::Point, cv::Point>& map)
+    const cv::Mat& occlusionMask,
+    const cv::Mat& polarMap)
 {
-    out = cv::Mat::zeros(src.size(), CV_8UC1);
+    out = cv::Mat::zeros(size, CV_8UC1);
     
-    for (int y = 0; y < lowerEyelidMask.rows; y++)
-        for (int x = 0; x < lowerEyelidMask.cols; x++)
-            if (lowerEyelidMask.at<uchar>(y, x) == 0 || reflectionsMask.at<uchar>(y, x) != 0)
-                out.at<uchar>(map.at(cv::Point(x, y))) = 255;
-
-    for (int x = 0; x < src.cols; x++)
+    for (int y = 0; y < occlusionMask.rows; y++)
     {
-        int upperEyelidEdge = 0;
-        for (const auto& p : upperEyelidPoints)
-            if (p.x == x) upperEyelidEdge = p.y;
+        const auto* cart = polarMap.ptr<cv::Vec2s>(y);
+        for (int x = 0; x < occlusionMask.cols; x++)
+            if (occlusionMask.at<uchar>(y, x) != 0 && cart[x][0] >= 0)
+                out.at<uchar>(cart[x][1], cart[x][0]) = 255;
+    }
 
-        for (int y = 0; y < src.rows; y++)
-            if (limbus.inside(x, y) && (y < upperEyelidEdge)) out.at<uchar>(y, x) = 255;
+    for (int x = 0; x < size.width; x++)
+    {
+        int upperEdge = upperEyelidEdge(upperEyelidPoints, x);
+        for (int y = 0; y < std::min(upperEdge, size.height); y++)
+            if (limbus.inside(x, y)) out.at<uchar>(y, x) = 255;
     }
 }
 
-void irisMask(const cv::Mat& src, cv::Mat& out, const Circle& limbus, const Circle& pupil, const cv::Mat& negMask)
+void irisMask(const cv::Size& size, cv::Mat& out, const Circle& limbus, const Circle& pupil, const cv::Mat& negMask)
 {
-    out = cv::Mat::zeros(src.size(), CV_8UC1);
+    out = cv::Mat::zeros(size, CV_8UC1);
 
     cv::circle(out, limbus.center, (int)limbus.radius - 1, cv::Scalar(255), -1);
     cv::circle(out, pupil.center, (int)pupil.radius, cv::Scalar(0), -1);
 
-    for (int y = 0; y < src.rows; y++)
-        for (int x = 0; x < src.cols; x++)
+    for (int y = 0; y < size.height; y++)
+        for (int x = 0; x < size.width; x++)
             if (negMask.at<uchar>(y, x) > 0.) out.at<uchar>(y, x) = 0;
 }
 
-
-void normalizedMask(const cv::Mat& irisCroppedMask, cv::Mat& mask,
-    const cv::Size& normalizedSize,
-    const map<cv::Point, cv::Point>& mapCartPol)
+void normalizedMask(cv::Mat& mask, const Circle& limbus, const Circle& pupil,
+    const std::vector<cv::Point>& upperEyelidPoints,
+    const cv::Mat& occlusionMask,
+    const cv::Mat& polarMap)
 {
-    mask = cv::Mat::zeros(normalizedSize, CV_8UC1);
-    
+    // Rows of the limbus and pupil discs as irisMask draws them
+    std::vector<int> limbusSpans, pupilSpans;
+    filledCircleSpans(std::max(0, (int)limbus.radius - 1), limbusSpans);
+    filledCircleSpans(pupil.radius, pupilSpans);
+    auto inDisc = [](const std::vector<int>& spans, const Circle& c, int x, int y) {
+        int dy = std::abs(y - c.center[1]);
+        return dy < static_cast<int>(spans.size()) && std::abs(x - c.center[0]) <= spans[dy];
+    };
+
+    // Every polar point tests the cartesian pixel it samples: inside the iris ring, not occluded, below the upper eyelid
+    mask.create(occlusionMask.size(), CV_8UC1);
     for (int y = 0; y < mask.rows; y++)
+    {
+        const auto* cart = polarMap.ptr<cv::Vec2s>(y);
+        const uchar* occluded = occlusionMask.ptr<uchar>(y);
+        uchar* m = mask.ptr<uchar>(y);
         for (int x = 0; x < mask.cols; x++)
         {
-            auto polar = mapCartPol.find(cv::Point(x, y));
-            //if (polar == mapCartPol.end()) continue;
-            //if (!inside(irisCroppedMask.size(), polar)) continue;
-            if ((int)irisCroppedMask.at<uchar>(polar->second) == 255)
-            {
-                mask.at<uchar>(y, x) = 255;
-            }
+            int cx = cart[x][0], cy = cart[x][1];
+            bool visible = cx >= 0 && !occluded[x] && inDisc(limbusSpans, limbus, cx, cy) && !inDisc(pupilSpans, pupil, cx, cy)
+                && !(cy < upperEyelidEdge(upperEyelidPoints, cx) && limbus.inside(cx, cy));
+            m[x] = visible ? 255 : 0;
         }
-    
+    }
+}
+
+struct EyeMaskSource
+{
+    cv::Size size;
+    Iris iris;
+    std::vector<cv::Point> upperEyelidPoints;
+    // Polar points occluded by the lower eyelid or by reflections
+    cv::Mat occlusionMask;
+    cv::Mat polarMap;
+
+    std::once_flag computed;
+    cv::Mat eyeMask;
+};
+
+const cv::Mat& NormalizedIris::eyeMask() const
+{
+    static const cv::Mat empty;
+    if (!eyeMaskSource) return empty;
+    auto& source = *eyeMaskSource;
+    std::call_once(source.computed, [&source]()
+    {
+        cv::Mat negMask;
+        negativeMask(source.size, negMask, source.iris.limbus, source.upperEyelidPoints, source.occlusionMask, source.polarMap);
+        irisMask(source.size, source.eyeMask, source.iris.limbus, source.iris.pupil, negMask);
+    });
+    return source.eyeMask;
 }
 
-NormalizedIris normalizeIris(const cv::Mat& eye, const Iris& iris)
+NormalizedIris normalizeIris(const cv::Mat& eye, const Iris& iris, const NormalizationParams& params, int outputs)
 {
     NormalizedIris record;
-    record.eye = eye;
+    if (outputs & NORMALIZED_EYE) record.eye = eye;
+    // Masks are built from the normalized iris, nothing else to do if none of them is asked for
+    bool masks = outputs & (NORMALIZED_IRIS_MASK | NORMALIZED_EYE_MASK);
+    if (!masks && !(outputs & NORMALIZED_IRIS)) return record;
 
-    cv::Mat grayEye;
-    cv::cvtColor(eye, grayEye, cv::COLOR_BGR2GRAY);
+    // normalize iris
+    cv::Mat polarMap;
+    normalizeKrupicka(eye, record.irisNormalized, iris.limbus, iris.pupil, polarMap, params);
+    if (!masks) return record;
 
+    // Eyelash smoothing and gradient only between the limbus top and the pupil
+    cv::Rect upperBand = eyelidBand(eye.size(), iris.limbus, iris.pupil, true);
     cv::Mat gradientUp;
-    lashAttenuation(grayEye, gradientUp);
+    lashAttenuation(eye, gradientUp, upperBand);
 
     // upper eyelid points
-    auto upperEyelidPoints = findEyelidPoints(gradientUp, iris.limbus, iris.pupil, true);
-
-    // normalize iris
-    map<cv::Point, cv::Point> mapCartPol, mapPolCart;
-    normalizeKrupicka(eye, record.irisNormalized, iris.limbus, iris.pupil, mapCartPol, mapPolCart);
+    auto upperEyelidPoints = findEyelidPoints(gradientUp, upperBand, iris.limbus, iris.pupil, true);
 
     // split channels
     std::vector<cv::Mat> normalizedBGR;
@@ -209,15 +351,27 @@ NormalizedIris normalizeIris(const cv::Mat& eye, const Iris& iris)
     // reflection mask
     cv::adaptiveThreshold(normalizedBGR[0], reflectionMask, 255, cv::ADAPTIVE_THRESH_GAUSSIAN_C, cv::THRESH_BINARY, 3, -10);
 
-    // negative mask
-    cv::Mat negMask;
-    negativeMask(eye, negMask, iris.limbus, iris.pupil, upperEyelidPoints, lowEyelidMask, reflectionMask, mapCartPol);
+    // Polar points hidden by the lower eyelid or by reflections
+    cv::Mat occlusionMask(lowEyelidMask.size(), CV_8UC1);
+    for (int y = 0; y < occlusionMask.rows; y++)
+        for (int x = 0; x < occlusionMask.cols; x++)
+            occlusionMask.at<uchar>(y, x) = (lowEyelidMask.at<uchar>(y, x) == 0 || reflectionMask.at<uchar>(y, x) != 0) ? 255 : 0;
+    if (!(outputs & NORMALIZED_IRIS)) record.irisNormalized.release();
 
-    // iris mask
-    irisMask(eye, record.eyeMask, iris.limbus, iris.pupil, negMask);
+    // iris mask normalized, straight in the polar domain
+    if (outputs & NORMALIZED_IRIS_MASK)
+        normalizedMask(record.irisNormalizedMask, iris.limbus, iris.pupil, upperEyelidPoints, occlusionMask, polarMap);
 
-    // iris mask normalized
-    normalizedMask(record.eyeMask, record.irisNormalizedMask, record.irisNormalized.size(), mapCartPol);
+    // The cartesian iris mask is only drawn if it's asked for
+    if (outputs & NORMALIZED_EYE_MASK)
+    {
+        record.eyeMaskSource = std::make_shared<EyeMaskSource>();
+        record.eyeMaskSource->size = eye.size();
+        record.eyeMaskSource->iris = iris;
+        record.eyeMaskSource->upperEyelidPoints = std::move(upperEyelidPoints);
+        record.eyeMaskSource->occlusionMask = occlusionMask;
+        record.eyeMaskSource->polarMap = polarMap;
+    }
 	return record;
 }
 
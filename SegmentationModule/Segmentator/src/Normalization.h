@@ -1,26 +1,41 @@
 #ifndef __NORMALIZATION_H_
 #define __NORMALIZATION_H_
-#include <map>
 #include <opencv2/imgproc.hpp>
+#include <memory>
 
 namespace erb{
 
-struct ComparePoints
-{
-    inline bool operator () (const cv::Point& a, const cv::Point& b) const { return (a.x < b.x) || (a.x == b.x && a.y < b.y); }
-};
-
-template<typename KeyT, typename ValT>
-using map = std::map<KeyT, ValT, ComparePoints>;
-
 // Contains all information about normalized segmented iris image
 struct NormalizedIris
 {
     cv::Mat eye;
     cv::Mat irisNormalized;
 
-    cv::Mat eyeMask;
     cv::Mat irisNormalizedMask;
+
+    /**
+    * Iris mask in eye image coordinates, computed on the first call (masks are built in the normalized domain)
+    *
+    * @return eye sized mask, 255 on visible iris pixels; empty if the iris was not normalized
+    */
+    const cv::Mat& eyeMask() const;
+
+    // What eyeMask is computed from, shared by the copies of this record
+    std::shared_ptr<struct EyeMaskSource> eyeMaskSource;
+};
+
+// How the normalized iris is sampled from the eye image
+enum struct NormalizationSampling { NEAREST, BILINEAR, AREA };
+
+// NormalizedIris images produced by normalizeIris, as a bitmask (same bits as the server outputs)
+enum NormalizationOutput : int { NORMALIZED_IRIS = 1, NORMALIZED_IRIS_MASK = 2, NORMALIZED_EYE_MASK = 4, NORMALIZED_EYE = 8, NORMALIZED_ALL = 15 };
+
+// Normalization output options
+struct NormalizationParams
+{
+    // Size of the normalized iris (width = angles, height = radii), if empty it's 2*PI*r x 2*r (r = limbus radius)
+    cv::Size size;
+    NormalizationSampling sampling = NormalizationSampling::NEAREST;
 };
 
 struct Iris;
@@ -30,9 +45,11 @@ struct Iris;
 *
 * @param eye: Eye cropped image
 * @param iris: iris circles
+* @param params: output size and sampling, masks are produced at the same size
+* @param outputs: NormalizationOutput bitmask, images not asked for are left empty and their steps skipped
 * @return NormalizedIris struct containing all normalization informations
 */
-NormalizedIris normalizeIris(const cv::Mat& eye, const Iris& iris);
+NormalizedIris normalizeIris(const cv::Mat& eye, const Iris& iris, const NormalizationParams& params = {}, int outputs = NORMALIZED_ALL);
 
 };
 
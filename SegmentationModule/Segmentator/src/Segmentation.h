@@ -3,8 +3,11 @@
 
 #include "Util.h"
 #include "Normalization.h"
+#include "EyeDetector.h"
+#include "ImageSource.h"
 
 #include <opencv2/imgproc.hpp>
+#include <memory>
 
 
 // Segmentation
@@ -22,8 +25,37 @@ struct SegmentationData
 class Segmentator
 {
 public:
+	/*
+	* @param eyeDetector: eye detector shared with other segmentators, if null a new one is loaded
+	*/
+	explicit Segmentator(std::shared_ptr<const EyeDetector> eyeDetector = nullptr)
+		: mEyeDetector(eyeDetector ? std::move(eyeDetector) : std::make_shared<const EyeDetector>()) {}
 	virtual ~Segmentator() = default; 
-	virtual SegmentationData Segment(const cv::Mat& img) const = 0;
+	/*
+	* Segment an eye image. Implementations keep no state between calls,
+	* so one segmentator can be used by many threads at the same time
+	* @param src: eye image, possibly decoded at reduced resolution
+	* @param outputs: NormalizationOutput bitmask, callers only pay for the normalized images they use
+	*/
+	virtual SegmentationData Segment(const ImageSource& src, int outputs = NORMALIZED_ALL) const = 0;
+	/*
+	* Segment an eye image already decoded at full resolution
+	* @param img: eye image
+	* @param outputs: NormalizationOutput bitmask
+	*/
+	inline SegmentationData Segment(const cv::Mat& img, int outputs = NORMALIZED_ALL) const { return Segment(ImageSource(img), outputs); }
+
+	/*
+	* Size of the image the circles are searched in, images decoded for this segmentator
+	* (ImageSource::decode, ImageSource::read) don't need more resolution than that
+	*/
+	virtual int searchSize() const = 0;
+
+	/*
+	* Set size and sampling of the normalized iris produced by Segment
+	* @param params: normalization parameters
+	*/
+	inline void setNormalizationParams(const NormalizationParams& params) { mNormalizationParams = params; }
 protected:
 	/*
 	* Convert circle from one coordinate system to another
@@ -40,6 +72,9 @@ protected:
 		nc.radius = static_cast<float>(circle.radius) / static_cast<float>(from.width) * to.width;
 		return nc;
 	}
+protected:
+	std::shared_ptr<const EyeDetector> mEyeDetector;
+	NormalizationParams mNormalizationParams;
 };
 
 
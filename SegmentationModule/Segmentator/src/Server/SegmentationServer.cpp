@@ -0,0 +1,331 @@
+#include "Server/SegmentationServer.h"
+#include "Util.h"
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace erb
+{
+
+// Requests bigger than this are rejected
+constexpr uint32_t MAX_REQUEST_SIZE = 64u << 20;
+// A client that reads nothing of its reply for this long is dropped
+constexpr int WRITE_TIMEOUT_MS = 10000;
+
+SegmentationServer::SegmentationServer(std::shared_ptr<const Segmentator> segmentator, int workers, int queueSize)
+    : mSegmentator(std::move(segmentator)), mWorkers(std::max(workers, 1)), mQueueSize(std::max(queueSize, 1)), mRunning(false)
+{
+}
+
+#if !defined(_WIN32)
+
+// Write size bytes, waiting whenever the (non blocking) socket is full, up to WRITE_TIMEOUT_MS without progress
+bool writeAll(int fd, const void* data, size_t size)
+{
+    auto* p = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            pollfd pfd{ fd, POLLOUT, 0 };
+            int ready = ::poll(&pfd, 1, WRITE_TIMEOUT_MS);
+            if (ready == 0 || (ready < 0 && errno != EINTR)) return false;
+            continue;
+        }
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool writeImage(int fd, const cv::Mat& img)
+{
+    ServerImageHeader header{ (uint32_t)img.rows, (uint32_t)img.cols, (uint32_t)img.type() };
+    if (!writeAll(fd, &header, sizeof(header))) return false;
+    size_t rowSize = img.cols * img.elemSize();
+    if (img.isContinuous()) return writeAll(fd, img.data, rowSize * img.rows);
+    for (int y = 0; y < img.rows; y++)
+        if (!writeAll(fd, img.ptr(y), rowSize)) return false;
+    return true;
+}
+
+// Reply with a status only, without waiting: false if the socket cannot take the whole reply now
+bool sendStatus(int fd, ServerStatus status)
+{
+    ServerReplyHeader reply{};
+    reply.status = status;
+    ssize_t n;
+    do n = ::send(fd, &reply, sizeof(reply), MSG_DONTWAIT);
+    while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(sizeof(reply));
+}
+
+bool setNonBlocking(int fd)
+{
+    int flags = ::fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
+
+bool SegmentationServer::handleRequest(const Request& request) const
+{
+    const auto& header = request.header;
+    ServerReplyHeader reply{};
+
+    SegmentationData segmentation;
+    if (header.type != REQUEST_IMAGE && header.type != REQUEST_PATH)
+        reply.status = STATUS_BAD_REQUEST;
+    else
+    {
+        // An image OpenCV throws on must not take the server and the other requests down
+        try
+        {
+            // Decoded at the resolution of the circles search, the eye crop at full resolution
+            ImageSource img = header.type == REQUEST_IMAGE
+                ? ImageSource::decode(request.payload, mSegmentator->searchSize())
+                : ImageSource::read(std::string(request.payload.begin(), request.payload.end()), mSegmentator->searchSize());
+            if (img.empty())
+                reply.status = STATUS_READ_ERROR;
+            else
+            {
+                segmentation = mSegmentator->Segment(img, header.outputs);
+                reply.status = segmentation.iris.isValid() ? STATUS_OK : STATUS_SEGMENTATION_ERROR;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            LOG("Segmentation failed: " << e.what());
+            segmentation = {};
+            reply.status = STATUS_SEGMENTATION_ERROR;
+        }
+    }
+
+    const auto& iris = segmentation.iris;
+    const auto& normalized = segmentation.irisNormalized;
+    // Only the images asked for are produced
+    const cv::Mat* outputs[] = { &normalized.irisNormalized, &normalized.irisNormalizedMask, &normalized.eyeMask(), &normalized.eye };
+    if (reply.status == STATUS_OK)
+    {
+        reply.outputs = header.outputs & (OUTPUT_IRIS_NORMALIZED | OUTPUT_IRIS_NORMALIZED_MASK | OUTPUT_EYE_MASK | OUTPUT_EYE);
+        reply.pupil[0] = iris.pupil.center[0]; reply.pupil[1] = iris.pupil.center[1]; reply.pupil[2] = iris.pupil.radius;
+        reply.limbus[0] = iris.limbus.center[0]; reply.limbus[1] = iris.limbus.center[1]; reply.limbus[2] = iris.limbus.radius;
+    }
+
+    bool sent = writeAll(request.fd, &reply, sizeof(reply));
+    for (int i = 0; i < 4 && sent; i++)
+        if (reply.outputs & (1 << i)) sent = writeImage(request.fd, *outputs[i]);
+    return sent;
+}
+
+void SegmentationServer::wake() const
+{
+    char byte = 0;
+    while (::write(mWakeFds[1], &byte, 1) < 0 && errno == EINTR) {}
+}
+
+void SegmentationServer::worker()
+{
+    while (true)
+    {
+        Request request;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mQueueCv.wait(lock, [&]() { return !mQueue.empty() || !mRunning; });
+            if (mQueue.empty()) return;
+            request = std::move(mQueue.front());
+            mQueue.pop_front();
+        }
+        bool sent = handleRequest(request);
+        {
+            std::lock_guard<std::mutex> guard(mMutex);
+            mDone.emplace_back(request.fd, sent);
+        }
+        wake();
+    }
+}
+
+// Bytes read from a connection that is not in a worker
+struct Connection
+{
+    std::vector<uchar> buffer;
+    // A request of this connection is queued or served
+    bool busy = false;
+};
+
+bool SegmentationServer::serve(const std::string& socketPath)
+{
+    sockaddr_un address{};
+    if (socketPath.size() >= sizeof(address.sun_path))
+    {
+        LOG("Socket path too long: " << socketPath);
+        return false;
+    }
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    int listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(socketPath.c_str());
+    if (listenFd < 0 || ::bind(listenFd, (sockaddr*)&address, sizeof(address)) < 0 || ::listen(listenFd, SOMAXCONN) < 0
+        || ::pipe(mWakeFds) < 0)
+    {
+        LOG("Cannot listen on " << socketPath << ": " << std::strerror(errno));
+        if (listenFd >= 0) ::close(listenFd);
+        return false;
+    }
+    setNonBlocking(mWakeFds[0]);
+    setNonBlocking(mWakeFds[1]);
+    // A client closing its connection must not kill the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    mRunning = true;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < mWorkers; i++) workers.emplace_back(&SegmentationServer::worker, this);
+    LOG("Listening on " << socketPath << " with " << mWorkers << " workers");
+
+    std::unordered_map<int, Connection> connections;
+    auto closeConnection = [&](int fd) { ::close(fd); connections.erase(fd); };
+
+    // Queue the complete requests buffered for a connection, one at a time
+    auto dispatch = [&](int fd)
+    {
+        auto& connection = connections[fd];
+        while (!connection.busy && connection.buffer.size() >= sizeof(ServerRequestHeader))
+        {
+            Request request;
+            request.fd = fd;
+            std::memcpy(&request.header, connection.buffer.data(), sizeof(ServerRequestHeader));
+            if (request.header.size > MAX_REQUEST_SIZE)
+            {
+                sendStatus(fd, STATUS_BAD_REQUEST);
+                closeConnection(fd);
+                return;
+            }
+            size_t requestSize = sizeof(ServerRequestHeader) + request.header.size;
+            if (connection.buffer.size() < requestSize) return;
+            request.payload.assign(connection.buffer.begin() + sizeof(ServerRequestHeader), connection.buffer.begin() + requestSize);
+            connection.buffer.erase(connection.buffer.begin(), connection.buffer.begin() + requestSize);
+
+            std::unique_lock<std::mutex> lock(mMutex);
+            if (mQueue.size() >= mQueueSize)
+            {
+                lock.unlock();
+                // Sent from the poll thread: a client that doesn't read its replies is dropped, not waited for
+                if (!sendStatus(fd, STATUS_BUSY))
+                {
+                    closeConnection(fd);
+                    return;
+                }
+                continue;
+            }
+            mQueue.push_back(std::move(request));
+            lock.unlock();
+            connection.busy = true;
+            mQueueCv.notify_one();
+        }
+    };
+
+    std::vector<pollfd> pfds;
+    std::vector<std::pair<int, bool>> done;
+    uchar chunk[1 << 16];
+    while (mRunning)
+    {
+        // Connections whose reply has been written are read again, they may have buffered the next request
+        {
+            std::lock_guard<std::mutex> guard(mMutex);
+            done.swap(mDone);
+        }
+        for (auto [fd, usable] : done)
+        {
+            if (!usable)
+            {
+                closeConnection(fd);
+                continue;
+            }
+            connections[fd].busy = false;
+            dispatch(fd);
+        }
+        done.clear();
+
+        // Listening socket, wake up pipe and the connections not in a worker
+        pfds.assign({ { listenFd, POLLIN, 0 }, { mWakeFds[0], POLLIN, 0 } });
+        for (const auto& [fd, connection] : connections)
+            if (!connection.busy) pfds.push_back({ fd, POLLIN, 0 });
+        // Wake up periodically to check if the server has been stopped
+        if (::poll(pfds.data(), pfds.size(), 200) <= 0) continue;
+
+        if (pfds[1].revents) while (::read(mWakeFds[0], chunk, sizeof(chunk)) > 0) {}
+        if (pfds[0].revents & POLLIN)
+        {
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd >= 0 && setNonBlocking(fd)) connections[fd];
+            else if (fd >= 0) ::close(fd);
+        }
+        for (size_t i = 2; i < pfds.size(); i++)
+        {
+            if (!pfds[i].revents) continue;
+            int fd = pfds[i].fd;
+            auto& buffer = connections[fd].buffer;
+            bool open = true;
+            while (true)
+            {
+                ssize_t n = ::read(fd, chunk, sizeof(chunk));
+                if (n > 0) buffer.insert(buffer.end(), chunk, chunk + n);
+                else if (n < 0 && errno == EINTR) continue;
+                else
+                {
+                    // Closed by the client (0) or error, unless there's just nothing left to read
+                    open = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                    break;
+                }
+            }
+            if (open) dispatch(fd);
+            else closeConnection(fd);
+        }
+    }
+
+    // Queued requests are dropped, the ones in a worker are completed
+    {
+        std::lock_guard<std::mutex> guard(mMutex);
+        mQueue.clear();
+    }
+    mQueueCv.notify_all();
+    for (auto& t : workers) t.join();
+    for (const auto& [fd, connection] : connections) ::close(fd);
+    mDone.clear();
+    ::close(mWakeFds[0]);
+    ::close(mWakeFds[1]);
+    mWakeFds[0] = mWakeFds[1] = -1;
+    ::close(listenFd);
+    ::unlink(socketPath.c_str());
+    return true;
+}
+
+#else
+
+bool SegmentationServer::serve(const std::string& socketPath)
+{
+    LOG("Segmentation server is not supported on this platform");
+    return false;
+}
+
+#endif
+
+}
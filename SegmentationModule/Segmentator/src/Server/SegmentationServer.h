@@ -0,0 +1,119 @@
+#ifndef __SEGMENTATIONSERVER_H_
+#define __SEGMENTATIONSERVER_H_
+
+#include "Segmentation.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace erb
+{
+
+/*
+* Wire format (native byte order, little endian on every supported platform):
+* request: ServerRequestHeader, then `size` bytes (encoded image or UTF-8 image path)
+* reply:   ServerReplyHeader, then for every bit set in `outputs` (lowest bit first)
+*          a ServerImageHeader followed by rows * cols * elemSize raw bytes
+* A connection can send any number of requests, one reply is sent for each.
+*/
+enum ServerRequestType : uint8_t { REQUEST_IMAGE = 0, REQUEST_PATH = 1 };
+enum ServerOutput : uint8_t { OUTPUT_IRIS_NORMALIZED = 1, OUTPUT_IRIS_NORMALIZED_MASK = 2, OUTPUT_EYE_MASK = 4, OUTPUT_EYE = 8 };
+enum ServerStatus : uint8_t { STATUS_OK = 0, STATUS_READ_ERROR = 1, STATUS_SEGMENTATION_ERROR = 2, STATUS_BAD_REQUEST = 3, STATUS_BUSY = 4 };
+
+struct ServerRequestHeader
+{
+    uint8_t type;
+    // ServerOutput bitmask
+    uint8_t outputs;
+    uint16_t reserved;
+    uint32_t size;
+};
+
+struct ServerReplyHeader
+{
+    uint8_t status;
+    uint8_t outputs;
+    uint16_t reserved;
+    // center x, center y, radius
+    int32_t pupil[3];
+    int32_t limbus[3];
+};
+
+struct ServerImageHeader
+{
+    uint32_t rows;
+    uint32_t cols;
+    // OpenCV type, e.g. CV_8UC3
+    uint32_t type;
+};
+
+static_assert(OUTPUT_IRIS_NORMALIZED == NORMALIZED_IRIS && OUTPUT_IRIS_NORMALIZED_MASK == NORMALIZED_IRIS_MASK && OUTPUT_EYE_MASK == NORMALIZED_EYE_MASK && OUTPUT_EYE == NORMALIZED_EYE,
+    "Server outputs are passed to Segment as they are");
+static_assert(sizeof(ServerRequestHeader) == 8 && sizeof(ServerReplyHeader) == 28 && sizeof(ServerImageHeader) == 12, "Unexpected padding in server headers");
+
+/*
+* Segmentation daemon listening on a Unix domain socket.
+* serve() polls every connection and puts each complete request in a bounded queue, a pool of workers
+* sharing one segmentator serves them, so idle workers are shared by every connected client.
+* A connection has at most one request in a worker at a time, so its replies keep the requests order.
+*/
+class SegmentationServer
+{
+public:
+    /*
+    * @param segmentator: segmentator shared by the workers
+    * @param workers: number of worker threads
+    * @param queueSize: max number of requests waiting for a worker, others are answered with STATUS_BUSY
+    */
+    SegmentationServer(std::shared_ptr<const Segmentator> segmentator, int workers, int queueSize);
+
+    /*
+    * Listen on socketPath and serve requests until stop() is called
+    * @param socketPath: path of the Unix domain socket
+    * @return false if the socket cannot be opened
+    */
+    bool serve(const std::string& socketPath);
+    // Ask serve() to return, safe to call from a signal handler
+    inline void stop() { mRunning = false; }
+private:
+    // A request read from a connection, waiting for a worker
+    struct Request
+    {
+        int fd;
+        ServerRequestHeader header;
+        std::vector<uchar> payload;
+    };
+
+    void worker();
+    /*
+    * Segment a request and write its reply on the request connection
+    * @return false if the reply cannot be sent
+    */
+    bool handleRequest(const Request& request) const;
+    // Wake serve() up from a worker
+    void wake() const;
+private:
+    std::shared_ptr<const Segmentator> mSegmentator;
+    int mWorkers;
+    size_t mQueueSize;
+
+    std::atomic_bool mRunning;
+    std::mutex mMutex;
+    std::condition_variable mQueueCv;
+    std::deque<Request> mQueue;
+    // Connections whose reply has been written and whether they are still usable, polled again by serve()
+    std::vector<std::pair<int, bool>> mDone;
+    // Pipe waking serve() when a reply has been written
+    int mWakeFds[2] = { -1, -1 };
+};
+
+}
+
+#endif // !__SEGMENTATIONSERVER_H_
@@ -1,104 +1,238 @@
 #include "Util.h"
+#include "Execution.h"
 
 #include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
 
 namespace erb {
 
-double homogeneity(const cv::Mat& src, const Circle& circle)
+void filledCircleSpans(int radius, std::vector<int>& halfWidths)
 {
-    // Calculating the circle mask
-    cv::Mat circleMask = cv::Mat::zeros(src.size(), CV_8UC1);
-    cv::circle(circleMask, circle.center, circle.radius, cv::Scalar(255), -1);
+    halfWidths.assign(radius + 1, 0);
+    // Same integer midpoint walk as cv::circle
+    int err = 0, dx = radius, dy = 0, plus = 1, minus = (radius << 1) - 1;
+    while (dx >= dy)
+    {
+        halfWidths[dy] = std::max(halfWidths[dy], dx);
+        halfWidths[dx] = std::max(halfWidths[dx], dy);
+        dy++;
+        err += plus;
+        plus += 2;
+        int mask = (err <= 0) - 1;
+        err -= minus & mask;
+        dx += mask;
+        minus -= mask & 2;
+    }
+}
 
-    // Calculating the histogram on that circle
-    int channels[] = { 0 };
-    int histSize[] = { 256 };
+/*
+* Half width of every row of the pixels strictly closer than radius to the center
+* @param radius: circle radius
+* @param halfWidths: row k above and below the center spans center -+ halfWidths[k], -1 if empty
+*/
+void innerCircleSpans(int radius, std::vector<int>& halfWidths)
+{
+    halfWidths.assign(radius + 1, -1);
+    int radius2 = radius * radius;
+    for (int k = 0; k < radius; k++)
+    {
+        // Largest w with w^2 + k^2 < radius^2
+        int w = static_cast<int>(std::sqrt(static_cast<double>(radius2 - k * k - 1)));
+        while (w * w + k * k >= radius2) w--;
+        while ((w + 1) * (w + 1) + k * k < radius2) w++;
+        halfWidths[k] = w;
+    }
+}
 
-    float lranges[] = { 0, 256 };
-    const float* ranges[] = { lranges };
-    cv::Mat hist;
-    cv::calcHist(&src, 1, channels, circleMask, hist, 1, histSize, ranges, true, false);
+/*
+* Walk the rows of a circle clipped to the image
+* @param halfWidths: spans of the circle rows
+* @param fn: called as fn(row, x0, x1) for the pixels x0..x1 (included) of each row
+*/
+template<typename F>
+void forEachSpan(const cv::Mat& src, const Circle& circle, const std::vector<int>& halfWidths, F fn)
+{
+    int cx = circle.center[0], cy = circle.center[1];
+    for (int k = 0; k < static_cast<int>(halfWidths.size()); k++)
+    {
+        if (halfWidths[k] < 0) continue;
+        int x0 = std::max(0, cx - halfWidths[k]), x1 = std::min(src.cols - 1, cx + halfWidths[k]);
+        if (x0 > x1) continue;
+        // Rows above and below the center, only once for the center row
+        for (int y : { cy - k, cy + k })
+        {
+            if (y >= 0 && y < src.rows) fn(src.ptr<uchar>(y), x0, x1);
+            if (k == 0) break;
+        }
+    }
+}
+
+double homogeneity(const cv::Mat& src, const Circle& circle)
+{
+    // Histogram of the pixels of the filled circle, built straight from its rows
+    thread_local std::vector<int> halfWidths;
+    filledCircleSpans(circle.radius, halfWidths);
+    std::array<int, 256> hist{};
+    forEachSpan(src, circle, halfWidths, [&](const uchar* row, int x0, int x1) {
+        for (int x = x0; x <= x1; x++) hist[row[x]]++;
+    });
 
     // I use the formula for homogeneity
-    double totalPx = 0, maxVal = 0, color = 0;
-    for (int i = 0; i < hist.rows; i++)
+    int totalPx = 0, maxVal = 0;
+    for (int count : hist)
     {
-        totalPx += hist.at<float>(i, 0);
-        if (hist.at<float>(i, 0) > maxVal)
+        totalPx += count;
+        maxVal = std::max(maxVal, count);
+    }
+
+    return totalPx > 0 ? static_cast<double>(maxVal) / totalPx : 0;
+}
+
+std::vector<double> homogeneity(const cv::Mat& src, const std::vector<Circle>& circles)
+{
+    std::vector<double> scores(circles.size());
+    parallelFor(circles.size(), [&](size_t i) { scores[i] = homogeneity(src, circles[i]); });
+    return scores;
+}
+
+// cos and sin of every integer angle in degrees
+struct UnitCircleTable
+{
+    double cos[360];
+    double sin[360];
+};
+
+// cos(x) for x in [0, pi/2], Taylor series
+constexpr double cosSeries(double x)
+{
+    double term = 1, sum = 1;
+    for (int n = 1; n < 16; n++)
+    {
+        term *= -x * x / ((2 * n - 1) * (2 * n));
+        sum += term;
+    }
+    return sum;
+}
+
+// cos of an angle in [0, 90] degrees, exact at 0 and 90
+constexpr double quadrantCos(int degrees)
+{
+    return degrees == 0 ? 1. : degrees == 90 ? 0. : cosSeries(degrees * M_PI / 180.);
+}
+
+constexpr UnitCircleTable makeUnitCircleTable()
+{
+    UnitCircleTable table{};
+    for (int a = 0; a < 360; a++)
+    {
+        if (a <= 90) { table.cos[a] = quadrantCos(a); table.sin[a] = quadrantCos(90 - a); }
+        else if (a <= 180) { table.cos[a] = -quadrantCos(180 - a); table.sin[a] = quadrantCos(a - 90); }
+        else if (a <= 270) { table.cos[a] = -quadrantCos(a - 180); table.sin[a] = -quadrantCos(270 - a); }
+        else { table.cos[a] = quadrantCos(360 - a); table.sin[a] = -quadrantCos(a - 270); }
+    }
+    return table;
+}
+
+constexpr UnitCircleTable UNIT_CIRCLE = makeUnitCircleTable();
+
+// Sample offsets from the circle center, the same for every circle with a given radius
+struct SeparabilitySamples
+{
+    int innerX[360], innerY[360];
+    int outerX[360], outerY[360];
+};
+
+/*
+* Offsets of the separability samples of a radius, computed once per thread and radius
+* @param radius: circle radius
+* @return inner (4/5 of the radius) and outer (6/5 of the radius) sample offsets
+*/
+const SeparabilitySamples& separabilitySamples(int radius)
+{
+    thread_local std::vector<std::unique_ptr<SeparabilitySamples>> cache;
+    if (radius >= static_cast<int>(cache.size())) cache.resize(radius + 1);
+    auto& samples = cache[radius];
+    if (!samples)
+    {
+        samples = std::make_unique<SeparabilitySamples>();
+        // Offsets that are integers up to rounding (e.g. at multiples of 30 degrees) stay on the circle
+        auto offset = [](double v) { return static_cast<int>(std::floor(v + 1e-9)); };
+        for (int i = 0; i < 360; i++)
         {
-            maxVal = hist.at<float>(i, 0);
-            color = i;
+            samples->innerX[i] = offset(radius * 0.8 * UNIT_CIRCLE.cos[i]);
+            samples->innerY[i] = offset(radius * 0.8 * UNIT_CIRCLE.sin[i]);
+            samples->outerX[i] = offset(radius * 1.2 * UNIT_CIRCLE.cos[i]);
+            samples->outerY[i] = offset(radius * 1.2 * UNIT_CIRCLE.sin[i]);
         }
     }
-
-    return maxVal / totalPx;
+    return *samples;
 }
 
 double separability(const cv::Mat& src, const Circle& c)
 {
-    // Array keeping differences for each angle
-    double indexes[360];
-
-    // total differences
-    double total = 0;
+    if (c.radius < 0) return 0;
+    const auto& samples = separabilitySamples(c.radius);
+    int cx = c.center[0], cy = c.center[1];
 
-    // For every angle
+    // Gather internal and external intensities of each angle, corrected if they end up outside the matrix
+    uchar inner[360], outer[360];
     for (int i = 0; i < 360; i++)
     {
-        // Internal abscissa, set to 4/5 of the radius
-        int xInt = (int)(c.center[0] + c.radius * 0.8 * cos(degToRad(i)));
-        // External abscissa, set at 6/5 of the radius
-        int xExt = (int)(c.center[0] + c.radius * 1.2 * cos(degToRad(i)));
-        // Internal ordinate, set at 4/5 of the radius
-        int yInt = (int)(c.center[1] + c.radius * 0.8 * sin(degToRad(i)));
-        // Outer ordinate, set at 6/5 of the radius
-        int yExt = (int)(c.center[1] + c.radius * 1.2 * sin(degToRad(i)));
-
-        // Corrects if external coordinates end up outside the matrix
-        xExt = xExt < 0 ? 0 : xExt;
-        yExt = yExt < 0 ? 0 : yExt;
-        xExt = xExt >= src.cols ? src.cols - 1 : xExt;
-        yExt = yExt >= src.rows ? src.rows - 1 : yExt;
-
-        // Gets the difference between internal and external intensities
-        indexes[i] = abs(src.at<uchar>(yExt, xExt) - src.at<uchar>(yInt, xInt));
-
-        // Update sum of differences
-        total += indexes[i];
+        int xInt = std::clamp(cx + samples.innerX[i], 0, src.cols - 1);
+        int yInt = std::clamp(cy + samples.innerY[i], 0, src.rows - 1);
+        int xExt = std::clamp(cx + samples.outerX[i], 0, src.cols - 1);
+        int yExt = std::clamp(cy + samples.outerY[i], 0, src.rows - 1);
+        inner[i] = src.ptr<uchar>(yInt)[xInt];
+        outer[i] = src.ptr<uchar>(yExt)[xExt];
+    }
 
+    // Sum and squared sum of the differences in a single pass
+    int total = 0, totalSq = 0;
+    for (int i = 0; i < 360; i++)
+    {
+        int difference = std::abs(outer[i] - inner[i]);
+        total += difference;
+        totalSq += difference * difference;
     }
     // Average difference in angles
     double mean = total / 360.;
-
-    // Calculation of standard deviation
-    double sum = 0;
-    for (int i = 0; i < 360; i++)
-        sum += cv::pow((indexes[i] - mean), 2);
-
-    double stddev = sqrt(sum / 360.);
+    double stddev = std::sqrt(std::max(0., totalSq / 360. - mean * mean));
 
     // Returns the mean value divided by the (standard deviation + 1)
     return mean / (stddev + 1);
 }
 
+std::vector<double> separability(const cv::Mat& src, const std::vector<Circle>& circles)
+{
+    std::vector<double> scores(circles.size());
+    parallelFor(circles.size(), [&](size_t i) { scores[i] = separability(src, circles[i]); });
+    return scores;
+}
+
 double mean(const cv::Mat& src, const Circle& circle)
 {
+    thread_local std::vector<int> halfWidths;
+    innerCircleSpans(circle.radius, halfWidths);
     double mean = 0;
     int countpx = 0;
-    cv::Rect r = circle.getbbox();
-    for (int i = r.tl().y; i < r.br().y; i++)
-    {
-        for (int j = r.tl().x; j < r.br().x; j++)
-        {
-            if (circle.inside(j, i))
-            {
-                mean += src.at<uchar>(i, j);
-                countpx++;
-            }
-        }
-    }
+    forEachSpan(src, circle, halfWidths, [&](const uchar* row, int x0, int x1) {
+        int sum = 0;
+        for (int x = x0; x <= x1; x++) sum += row[x];
+        mean += sum;
+        countpx += x1 - x0 + 1;
+    });
     mean /= countpx;
     return mean;
 }
 
+std::vector<double> mean(const cv::Mat& src, const std::vector<Circle>& circles)
+{
+    std::vector<double> means(circles.size());
+    parallelFor(circles.size(), [&](size_t i) { means[i] = mean(src, circles[i]); });
+    return means;
+}
+
 }
\ No newline at end of file
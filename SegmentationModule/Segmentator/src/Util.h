@@ -2,6 +2,7 @@
 #define _UTIL_H_
 #include<iostream>
 #include <opencv2/imgcodecs.hpp>
+#include <vector>
 
 #define DEBUG
 
@@ -80,6 +81,13 @@ inline std::ostream& operator<<(std::ostream& os, const Circle& c)
 	return os;
 }
 
+/*
+* Half width of every row of a filled circle, as cv::circle rasterizes it
+* @param radius: circle radius
+* @param halfWidths: row k above and below the center spans center -+ halfWidths[k]
+*/
+void filledCircleSpans(int radius, std::vector<int>& halfWidths);
+
 /*
 * Calculate homogeneity score of a circle in an image
 * @param src: input image
@@ -88,12 +96,26 @@ inline std::ostream& operator<<(std::ostream& os, const Circle& c)
 */
 double homogeneity(const cv::Mat& src, const Circle& circle);
 /*
+* Calculate homogeneity score of many circles in an image, in parallel
+* @param src: input image
+* @param circles: circles to test
+* @return homogeneity score of each circle
+*/
+std::vector<double> homogeneity(const cv::Mat& src, const std::vector<Circle>& circles);
+/*
 * Calculate separability score of a circle in an image
 * @param src: input image
 * @param circle: circle to test
 * @return separability score
 */
 double separability(const cv::Mat& src, const Circle& c);
+/*
+* Calculate separability score of many circles in an image, in parallel
+* @param src: input image
+* @param circles: circles to test
+* @return separability score of each circle
+*/
+std::vector<double> separability(const cv::Mat& src, const std::vector<Circle>& circles);
 
 /*
 * Calculate mean value in a circle in an image
@@ -102,6 +124,13 @@ double separability(const cv::Mat& src, const Circle& c);
 * @return mean value in circle
 */
 double mean(const cv::Mat& src, const Circle& circle);
+/*
+* Calculate mean value in many circles in an image, in parallel
+* @param src: input image
+* @param circles: circles to test
+* @return mean value in each circle
+*/
+std::vector<double> mean(const cv::Mat& src, const std::vector<Circle>& circles);
 
 // Define iris as two circles
 struct Iris
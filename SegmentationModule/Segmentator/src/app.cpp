@@ -1,8 +1,19 @@
 #include "Hough/HoughSegmentator.h"
 #include "Isis/IsisSegmentator.h"
+#include "Execution.h"
+#include "ImagePreproc.h"
+#include "Server/SegmentationServer.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <filesystem>
+#include <thread>
+#include <utility>
 #include <opencv2/opencv.hpp>
 
 #include <ezOptionParser.hpp>
@@ -12,17 +23,32 @@ namespace fs = std::filesystem;
 enum struct SegmentationMethod {HOUGH, ISIS};
 static std::unordered_map<std::string, SegmentationMethod> const methodTable = { {"hough", SegmentationMethod::HOUGH}, {"isis", SegmentationMethod::ISIS} };
 
-enum struct AppMode { APP_DEBUG, APP_SEGMENTATION };
-static std::unordered_map<std::string, AppMode> const appModeTable = { {"debug", AppMode::APP_DEBUG}, {"segmentation", AppMode::APP_SEGMENTATION} };
+static std::unordered_map<std::string, erb::NormalizationSampling> const samplingTable = { {"nearest", erb::NormalizationSampling::NEAREST}, {"bilinear", erb::NormalizationSampling::BILINEAR}, {"area", erb::NormalizationSampling::AREA} };
+
+// Images saved for each segmentation, named after their file suffix
+static std::unordered_map<std::string, erb::NormalizationOutput> const outputTable = { {"eyenorm", erb::NORMALIZED_IRIS}, {"eyenormmask", erb::NORMALIZED_IRIS_MASK}, {"eyemask", erb::NORMALIZED_EYE_MASK}, {"eye", erb::NORMALIZED_EYE} };
+
+static std::unordered_map<std::string, erb::ExecutionBackend> const executionTable = { {"serial", erb::ExecutionBackend::SERIAL}, {"pool", erb::ExecutionBackend::POOL}, {"std", erb::ExecutionBackend::STD_PARALLEL} };
+
+enum struct AppMode { APP_DEBUG, APP_SEGMENTATION, APP_BENCHMARK, APP_BATCH };
+static std::unordered_map<std::string, AppMode> const appModeTable = { {"debug", AppMode::APP_DEBUG}, {"segmentation", AppMode::APP_SEGMENTATION}, {"benchmark", AppMode::APP_BENCHMARK} };
 
 
 struct AppParams
 {
     SegmentationMethod segmentationMethod;
     int scaleSize;
+    erb::NormalizationParams normalization;
+    // NormalizationOutput bitmask of the images to save
+    int outputs;
     AppMode appMode;
     std::string input = "";
     std::string output = "";
+    int iterations;
+    int workers;
+    int queueSize;
+    erb::ExecutionBackend execution;
+    int threads;
 
 };
 
@@ -32,25 +58,200 @@ inline T getOrDefault(const std::unordered_map<K,T>& map, const K& key, T val)
     return (map.find(key) != map.end()) ? map.at(key) : val;
 }
 
+// Run fn n times and return the mean time in milliseconds
+template<typename F>
+inline double meanMillis(int n, F fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) fn();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / std::max(n, 1);
+}
+
+std::unique_ptr<erb::Segmentator> createSegmentator(const AppParams& params)
+{
+    std::unique_ptr<erb::Segmentator> segmentator;
+    switch (params.segmentationMethod)
+    {
+    case SegmentationMethod::HOUGH:
+        segmentator = std::unique_ptr<erb::Segmentator>(new hough::HoughSegmentator(params.scaleSize));
+        break;
+    case SegmentationMethod::ISIS:
+        segmentator = std::unique_ptr<erb::Segmentator>(new isis::IsisSegmentator(params.scaleSize));
+        break;
+    }
+    segmentator->setNormalizationParams(params.normalization);
+    return segmentator;
+}
+
+// Write segmentation images in outDirPath, named after the input image. Images that were not produced are skipped
+void saveSegmentation(fs::path imgPath, const fs::path& outDirPath, const erb::SegmentationData& segmentation)
+{
+    auto extension = imgPath.extension();
+    imgPath.replace_extension("");
+    const auto& normalized = segmentation.irisNormalized;
+    const std::pair<std::string, const cv::Mat*> images[] = { {"_eye", &normalized.eye}, {"_eyeNorm", &normalized.irisNormalized},
+        {"_eyeNormMask", &normalized.irisNormalizedMask}, {"_eyeMask", &normalized.eyeMask()} };
+    for (const auto& [suffix, image] : images)
+        if (!image->empty())
+            cv::imwrite((outDirPath / fs::path(imgPath.filename().string() + suffix + extension.string())).string(), *image);
+}
+
+/*
+* List batch images
+* @param batchPath: a directory (every file in it) or a manifest file (one image path per line, relative to the manifest)
+* @return image paths
+*/
+std::vector<fs::path> batchInputs(const fs::path& batchPath)
+{
+    std::vector<fs::path> inputs;
+    if (fs::is_directory(batchPath))
+    {
+        for (const auto& entry : fs::directory_iterator(batchPath))
+            if (entry.is_regular_file()) inputs.push_back(entry.path());
+        std::sort(inputs.begin(), inputs.end());
+        return inputs;
+    }
+
+    std::ifstream manifest(batchPath);
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        auto path = fs::path(line);
+        inputs.push_back(path.is_absolute() ? path : batchPath.parent_path() / path);
+    }
+    return inputs;
+}
+
+/*
+* Quote a csv field (RFC 4180), paths may contain commas and quotes
+* @param field: raw field
+* @return field between double quotes, with its double quotes doubled
+*/
+std::string csvQuote(const std::string& field)
+{
+    std::string quoted = "\"";
+    for (char c : field)
+    {
+        if (c == '"') quoted += '"';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+// Result of one batch image
+struct BatchRecord
+{
+    std::string status = "not_processed";
+    erb::Iris iris;
+    double millis = 0;
+};
+
+/*
+* Segment every batch image with params.workers threads and write a status csv in the output directory
+* @return number of images segmented
+*/
+int runBatch(const AppParams& params, const fs::path& outDirPath)
+{
+    auto inputs = batchInputs(fs::path(params.input));
+    auto records = std::vector<BatchRecord>(inputs.size());
+    int workers = std::max(1, std::min(params.workers, (int)inputs.size()));
+    if (!fs::exists(outDirPath)) fs::create_directories(outDirPath);
+
+    // Segment is reentrant: every worker uses the same segmentator
+    auto segmentator = createSegmentator(params);
+    std::atomic_int next = 0;
+    auto work = [&]() {
+        for (int i = next++; i < (int)inputs.size(); i = next++)
+        {
+            auto& record = records[i];
+            auto start = std::chrono::steady_clock::now();
+            // One image OpenCV throws on is recorded, the batch goes on
+            try
+            {
+                // Only the eye crop is decoded at full resolution
+                auto img = erb::ImageSource::read(inputs[i].string(), segmentator->searchSize());
+                if (img.empty())
+                    record.status = "read_error";
+                else
+                {
+                    auto segmentation = segmentator->Segment(img, params.outputs);
+                    if (!segmentation.iris.isValid())
+                        record.status = "segmentation_error";
+                    else
+                    {
+                        saveSegmentation(inputs[i], outDirPath, segmentation);
+                        record.status = "ok";
+                        record.iris = segmentation.iris;
+                    }
+                }
+            }
+            catch (const std::exception& e)
+            {
+                LOG("Segmentation of " << inputs[i] << " failed: " << e.what());
+                record.status = "exception";
+                record.iris = {};
+            }
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            record.millis = elapsed.count();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++) threads.emplace_back(work);
+    work();
+    for (auto& t : threads) t.join();
+
+    int failed = 0;
+    std::ofstream csv(outDirPath / "segmentation_status.csv");
+    csv << "image,status,pupil_x,pupil_y,pupil_r,limbus_x,limbus_y,limbus_r,millis\n";
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        const auto& r = records[i];
+        const auto& pupil = r.iris.pupil;
+        const auto& limbus = r.iris.limbus;
+        csv << csvQuote(inputs[i].string()) << "," << r.status << ","
+            << pupil.center[0] << "," << pupil.center[1] << "," << pupil.radius << ","
+            << limbus.center[0] << "," << limbus.center[1] << "," << limbus.radius << "," << r.millis << "\n";
+        if (r.status != "ok") failed++;
+    }
+    std::cout << "Segmented " << inputs.size() - failed << "/" << inputs.size() << " images" << std::endl;
+    return (int)inputs.size() - failed;
+}
+
+// Server stopped by SIGINT/SIGTERM
+static erb::SegmentationServer* runningServer = nullptr;
+
 int main(int argc, const char* argv[])
 {
 
     ez::ezOptionParser opt;
     opt.overview = "Segmentation application";
-    opt.syntax = "SegmentatorApp (--in|-i) \"inputImage\" [(--out|-o) \"outputDirectory\"] [--method|-mt (\"hough\"|\"isis\")] [--size|-sz n] [--mode|-m (\"debug\"|\"segmentation\")]";
+    opt.syntax = "SegmentatorApp ((--in|-i) \"inputImage\" | --batch \"directory|manifest.txt\" [-j n] | --serve \"socket\" [-j n] [--queue n]) [(--out|-o) \"outputDirectory\"] [--method|-mt (\"hough\"|\"isis\")] [--size|-sz n] [--mode|-m (\"debug\"|\"segmentation\"|\"benchmark\")] [--normsize|-ns WxH] [--sampling|-sm (\"nearest\"|\"bilinear\"|\"area\")] [--outputs|-os \"eyenorm,eyenormmask,eyemask,eye\"] [--iterations|-it n] [--threads|-t n] [--execution|-ex (\"serial\"|\"pool\"|\"std\")]";
     opt.example = "SegmentatorApp --in image.png\n\n";
     opt.footer = "------------------------\n";
 
     opt.add("hough", false, 1, ' ', "Iris segmentation method", "-mt", "--method");
     opt.add("250", false, 1, ' ', "Image scale size", "-sz", "--size");
-    opt.add("debug", false, 1, ' ', "App mode: debug segmentation or save segmentation", "-m", "--mode");
-    opt.add("", true, 1, ',', "Input image", "-i", "--in", "--input");
+    opt.add("", false, 1, ' ', "Normalized iris size as WxH (e.g. 200x64), native size if not set", "-ns", "--normsize");
+    opt.add("nearest", false, 1, ' ', "Normalized iris sampling", "-sm", "--sampling");
+    opt.add("eyenorm,eyenormmask,eyemask,eye", false, -1, ',', "Images saved for each segmentation (comma separated), the others are not computed", "-os", "--outputs");
+    opt.add("debug", false, 1, ' ', "App mode: debug segmentation, save segmentation or benchmark", "-m", "--mode");
+    opt.add("10", false, 1, ' ', "Benchmark iterations", "-it", "--iterations");
+    opt.add("", false, 1, ',', "Input image", "-i", "--in", "--input");
+    opt.add("", false, 1, ',', "Batch of images: a directory or a manifest file with one image path per line, outputs are saved in the output directory", "-b", "--batch");
+    opt.add("", false, 1, ',', "Run as a daemon listening on this Unix domain socket", "-sv", "--serve");
+    opt.add("1", false, 1, ' ', "Number of batch/server workers", "-j", "--jobs");
+    opt.add("16", false, 1, ' ', "Max requests waiting for a server worker", "-q", "--queue");
+    opt.add("0", false, 1, ' ', "Threads used by a single segmentation, 0 for every core", "-t", "--threads");
+    opt.add("serial", false, 1, ' ', "Parallel backend: serial (default), pool (internal thread pool) or std (std::execution::par)", "-ex", "--execution");
     opt.add("", false, 1, ',', "Output image", "-o", "--out");
     opt.add("", false, 1, ',', "Help", "-h", "--help");
     opt.parse(argc, argv);
 
     std::vector<std::string> badopt;
-    if (opt.isSet("-h") || !opt.gotRequired(badopt))
+    if (opt.isSet("-h") || !opt.gotRequired(badopt) || (!opt.isSet("-i") && !opt.isSet("-b") && !opt.isSet("-sv")))
     {
         std::string usage;
         opt.getUsage(usage);
@@ -68,12 +269,76 @@ int main(int argc, const char* argv[])
     opt.get("-sz")->getString(parse);
     params.scaleSize = std::atoi(parse.c_str());
 
+    // Normalized iris size and sampling
+    opt.get("-ns")->getString(parse);
+    int normWidth = 0, normHeight = 0;
+    if (!parse.empty() && std::sscanf(parse.c_str(), "%dx%d", &normWidth, &normHeight) != 2)
+    {
+        std::cout << "Invalid normalized iris size: " << parse << std::endl;
+        return -1;
+    }
+    params.normalization.size = cv::Size(normWidth, normHeight);
+    opt.get("-sm")->getString(parse);
+    params.normalization.sampling = getOrDefault(samplingTable, parse, erb::NormalizationSampling::NEAREST);
+
+    // Saved images
+    std::vector<std::string> outputs;
+    opt.get("-os")->getStrings(outputs);
+    params.outputs = 0;
+    for (const auto& output : outputs)
+    {
+        if (outputTable.find(output) == outputTable.end())
+        {
+            std::cout << "Invalid output: " << output << std::endl;
+            return -1;
+        }
+        params.outputs |= outputTable.at(output);
+    }
+
     // App mode
     opt.get("-m")->getString(parse);
     params.appMode = getOrDefault(appModeTable, parse, AppMode::APP_DEBUG);
 
-    // Input image
-    opt.get("-i")->getString(params.input);
+    // Benchmark iterations
+    opt.get("-it")->getString(parse);
+    params.iterations = std::atoi(parse.c_str());
+
+    // Batch workers
+    opt.get("-j")->getString(parse);
+    params.workers = std::atoi(parse.c_str());
+    opt.get("-q")->getString(parse);
+    params.queueSize = std::atoi(parse.c_str());
+
+    // Parallel backend of a single segmentation
+    opt.get("-ex")->getString(parse);
+    params.execution = getOrDefault(executionTable, parse, erb::ExecutionBackend::SERIAL);
+    opt.get("-t")->getString(parse);
+    params.threads = std::atoi(parse.c_str());
+    erb::setExecutionBackend(params.execution, params.threads);
+
+    if (opt.isSet("-sv"))
+    {
+        std::string socketPath;
+        opt.get("-sv")->getString(socketPath);
+        // Workers share the segmentator
+        erb::SegmentationServer server(createSegmentator(params), params.workers, params.queueSize);
+        runningServer = &server;
+        auto stopServer = [](int) { if (runningServer) runningServer->stop(); };
+        std::signal(SIGINT, stopServer);
+        std::signal(SIGTERM, stopServer);
+        bool served = server.serve(socketPath);
+        runningServer = nullptr;
+        return served ? 0 : -1;
+    }
+
+    // Input image (or batch)
+    if (opt.isSet("-b"))
+    {
+        params.appMode = AppMode::APP_BATCH;
+        opt.get("-b")->getString(params.input);
+    }
+    else
+        opt.get("-i")->getString(params.input);
     if (!fs::exists(fs::path(params.input)))
     {
         std::cout << "Input path to image does not exists, please select a valid one" << std::endl;
@@ -81,23 +346,15 @@ int main(int argc, const char* argv[])
         return -1;
     }
 
-    std::unique_ptr<erb::Segmentator> segmentator;
-    switch (params.segmentationMethod)
-    {
-    case SegmentationMethod::HOUGH:
-        segmentator = std::unique_ptr<erb::Segmentator>(new hough::HoughSegmentator(params.scaleSize));
-        break;
-    case SegmentationMethod::ISIS:
-        segmentator = std::unique_ptr<erb::Segmentator>(new isis::IsisSegmentator(params.scaleSize));
-        break;
-    }
+    // Batch creates its own segmentator
+    auto segmentator = params.appMode != AppMode::APP_BATCH ? createSegmentator(params) : nullptr;
 
     switch (params.appMode)
     {
     case AppMode::APP_DEBUG:
     {
         auto imgPath = fs::path(params.input);
-        cv::Mat img = cv::imread(imgPath.string(), cv::IMREAD_COLOR);
+        auto img = erb::ImageSource::read(imgPath.string(), segmentator->searchSize());
 
         auto segmentation = segmentator->Segment(img);
         if (!segmentation.iris.isValid())
@@ -129,9 +386,9 @@ int main(int argc, const char* argv[])
 
         auto imgPath = fs::path(params.input, fs::path::format::generic_format);
         auto outDirPath = fs::absolute(fs::path(params.output));
-        cv::Mat img = cv::imread(imgPath.string(), cv::IMREAD_COLOR);
+        auto img = erb::ImageSource::read(imgPath.string(), segmentator->searchSize());
         
-        auto segmentation = segmentator->Segment(img);
+        auto segmentation = segmentator->Segment(img, params.outputs);
         if (!segmentation.iris.isValid())
         {
             std::cout << "Error while segmenting iris image" << std::endl;
@@ -139,17 +396,64 @@ int main(int argc, const char* argv[])
         }
 
         if (!fs::exists(outDirPath)) fs::create_directories(outDirPath);
+        saveSegmentation(imgPath, outDirPath, segmentation);
+    }
+        break;
+    case AppMode::APP_BATCH:
+    {
+        // Output dir
+        if (!opt.isSet("-o")) {
+            std::string usage;
+            opt.getUsage(usage);
+            std::cout << usage << std::endl;
+            return -1;
+        }
+        opt.get("-o")->getString(params.output);
+        if (runBatch(params, fs::absolute(fs::path(params.output))) == 0) return -1;
+    }
+        break;
+    case AppMode::APP_BENCHMARK:
+    {
+        auto imgPath = fs::path(params.input);
+        // The crop works on gray images, the segmentators need the BGR image
+        cv::Mat img = cv::imread(imgPath.string(), cv::IMREAD_GRAYSCALE);
+        auto source = erb::ImageSource::read(imgPath.string(), segmentator->searchSize());
 
-        auto extension = imgPath.extension();
-        imgPath.replace_extension("");
-        auto eyePath = outDirPath / fs::path(imgPath.filename().string() + "_eye" + extension.string());
-        auto eyeNormPath = outDirPath / fs::path(imgPath.filename().string() + "_eyeNorm" + extension.string());
-        auto eyeNormMask = outDirPath / fs::path(imgPath.filename().string() + "_eyeNormMask" + extension.string());
-        auto eyeMask = outDirPath / fs::path(imgPath.filename().string() + "_eyeMask" + extension.string());
-        cv::imwrite(eyePath.string(), segmentation.irisNormalized.eye);
-        cv::imwrite(eyeNormPath.string(), segmentation.irisNormalized.irisNormalized);
-        cv::imwrite(eyeNormMask.string(), segmentation.irisNormalized.irisNormalizedMask);
-        cv::imwrite(eyeMask.string(), segmentation.irisNormalized.eyeMask);
+        // Cold: the cascade is loaded for every image, as a fresh detector would do
+        cv::Mat crop;
+        double cold = meanMillis(params.iterations, [&]() {
+            erb::EyeDetector detector;
+            erb::automaticCrop(img, crop, detector);
+        });
+
+        // Warm: one detector reused across images
+        erb::EyeDetector detector;
+        erb::automaticCrop(img, crop, detector);
+        double warm = meanMillis(params.iterations, [&]() { erb::automaticCrop(img, crop, detector); });
+
+        std::cout << "Crop latency (" << params.iterations << " iterations)" << std::endl;
+        std::cout << "cold: " << cold << " ms/image" << std::endl;
+        std::cout << "warm: " << warm << " ms/image" << std::endl;
+
+        // Segmentation latency scaling, from 1 to n threads (doubling)
+        int maxThreads = params.threads > 0 ? params.threads : std::max(1, (int)std::thread::hardware_concurrency());
+        if (params.execution == erb::ExecutionBackend::SERIAL) maxThreads = 1;
+        std::vector<int> threadCounts;
+        for (int threads = 1; threads < maxThreads; threads *= 2) threadCounts.push_back(threads);
+        threadCounts.push_back(maxThreads);
+
+        std::cout << "Segmentation latency (" << params.iterations << " iterations)" << std::endl;
+        double single = 0;
+        for (int threads : threadCounts)
+        {
+            erb::setExecutionBackend(params.execution, threads);
+            // Warm up the pool and the detector
+            segmentator->Segment(source, params.outputs);
+            double latency = meanMillis(params.iterations, [&]() { segmentator->Segment(source, params.outputs); });
+            if (threads == 1) single = latency;
+            std::cout << threads << " threads: " << latency << " ms/image, speedup " << single / latency << std::endl;
+        }
+        erb::setExecutionBackend(params.execution, params.threads);
     }
         break;
     }